@@ -0,0 +1,627 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "Bulk_status.h"
+#include "Interrupt.h"
+
+namespace hawk {
+
+namespace {
+
+constexpr unsigned max_depth = 256;
+constexpr unsigned max_pool_threads = 32;
+
+void interruption_point()
+{
+	soft_interruption_point();
+	hard_interruption_point();
+}
+
+int open_flags(const Bulk_status_options& opts)
+{
+	// Don't block on FIFOs or mandatory locks.
+	int flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY;
+	return (opts.follow_symlinks) ? flags : flags | O_NOFOLLOW;
+}
+
+// A minimal io_uring, just enough to queue requests and reap their
+// completions.
+class Uring
+{
+private:
+	int m_fd = -1;
+
+	void* m_sq_ptr = MAP_FAILED;
+	size_t m_sq_sz = 0;
+	void* m_cq_ptr = MAP_FAILED;
+	size_t m_cq_sz = 0;
+	io_uring_sqe* m_sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	size_t m_sqes_sz = 0;
+
+	unsigned* m_sq_tail;
+	unsigned* m_sq_mask;
+	unsigned* m_sq_array;
+	unsigned* m_cq_head;
+	unsigned* m_cq_tail;
+	unsigned* m_cq_mask;
+	io_uring_cqe* m_cqes;
+
+	// Our copy of the sq tail, it's published by submit().
+	unsigned m_tail = 0;
+	unsigned m_to_submit = 0;
+
+public:
+	Uring() {}
+	Uring(const Uring&) = delete;
+	Uring& operator=(const Uring&) = delete;
+
+	~Uring()
+	{
+		if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqes_sz);
+		if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+			munmap(m_cq_ptr, m_cq_sz);
+		if (m_sq_ptr != MAP_FAILED) munmap(m_sq_ptr, m_sq_sz);
+		if (m_fd != -1) close(m_fd);
+	}
+
+	// Returns false if io_uring isn't available or doesn't support
+	// the operations we need.
+	bool init(unsigned entries) noexcept
+	{
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+
+		m_fd = syscall(SYS_io_uring_setup, entries, &p);
+		if (m_fd == -1 || !supports_ops())
+			return false;
+
+		m_sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			m_sq_sz = m_cq_sz = std::max(m_sq_sz, m_cq_sz);
+
+		m_sq_ptr = mmap(nullptr, m_sq_sz, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		if (m_sq_ptr == MAP_FAILED)
+			return false;
+
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			m_cq_ptr = m_sq_ptr;
+		else
+		{
+			m_cq_ptr = mmap(nullptr, m_cq_sz, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, m_fd,
+							IORING_OFF_CQ_RING);
+			if (m_cq_ptr == MAP_FAILED)
+				return false;
+		}
+
+		m_sqes_sz = p.sq_entries * sizeof(io_uring_sqe);
+		void* sqes = mmap(nullptr, m_sqes_sz, PROT_READ | PROT_WRITE,
+						  MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+			return false;
+
+		m_sqes = static_cast<io_uring_sqe*>(sqes);
+
+		char* sq = static_cast<char*>(m_sq_ptr);
+		m_sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+		m_sq_mask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+		m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+		char* cq = static_cast<char*>(m_cq_ptr);
+		m_cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+		m_cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+		m_cq_mask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+		m_cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+		m_tail = *m_sq_tail;
+
+		return true;
+	}
+
+	// The caller never has more requests in flight than entries,
+	// so there always is a free sqe.
+	io_uring_sqe* get_sqe() noexcept
+	{
+		unsigned i = m_tail++ & *m_sq_mask;
+
+		io_uring_sqe* sqe = &m_sqes[i];
+		memset(sqe, 0, sizeof(*sqe));
+		m_sq_array[i] = i;
+		m_to_submit++;
+
+		return sqe;
+	}
+
+	// Submits the queued requests and waits for at least wait_nr
+	// completions. Returns errno.
+	int submit(unsigned wait_nr) noexcept
+	{
+		__atomic_store_n(m_sq_tail, m_tail, __ATOMIC_RELEASE);
+
+		for (;;)
+		{
+			unsigned flags = (wait_nr) ? IORING_ENTER_GETEVENTS : 0;
+			long n = syscall(SYS_io_uring_enter, m_fd, m_to_submit,
+							 wait_nr, flags, nullptr, 0);
+			if (n >= 0)
+			{
+				m_to_submit -= std::min<unsigned>(n, m_to_submit);
+				if (m_to_submit == 0)
+					return 0;
+
+				continue;
+			}
+
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				return errno;
+		}
+	}
+
+	// Calls fn(user_data, res) for the completed requests.
+	template <typename Fn>
+	void reap(Fn fn) noexcept(noexcept(fn(0, 0)))
+	{
+		unsigned head = *m_cq_head;
+		while (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+		{
+			const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+			__u64 data = cqe.user_data;
+			__s32 res = cqe.res;
+
+			__atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+			fn(data, res);
+		}
+	}
+
+private:
+	bool supports_ops() noexcept
+	{
+		constexpr unsigned nr_ops = 256;
+		alignas(io_uring_probe) char buf[sizeof(io_uring_probe) +
+										 nr_ops * sizeof(io_uring_probe_op)] {};
+		io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buf);
+
+		if (syscall(SYS_io_uring_register, m_fd, IORING_REGISTER_PROBE,
+					probe, nr_ops) != 0)
+			return false;
+
+		for (unsigned op : {IORING_OP_STATX, IORING_OP_OPENAT,
+							IORING_OP_READ, IORING_OP_CLOSE})
+		{
+			if (op > probe->last_op
+				|| !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+				return false;
+		}
+
+		return true;
+	}
+};
+
+// A name being queried. Every slot has a single request in flight.
+struct Slot
+{
+	enum class Stage {statx, open, read, close};
+
+	Stage stage;
+	struct statx stx;
+	int fd;
+	Bulk_status_result res;
+	std::unique_ptr<char[]> buf;
+};
+
+class Uring_query
+{
+private:
+	Uring& m_ring;
+	int m_dirfd;
+	const std::vector<const char*>& m_names;
+	const Bulk_status_options& m_opts;
+	const Bulk_status_callback& m_fn;
+
+	// Leaked if the requests in flight can't be waited for.
+	std::unique_ptr<Slot[]> m_slots;
+	std::vector<unsigned> m_free;
+	unsigned m_in_flight = 0;
+
+public:
+	Uring_query(Uring& ring, unsigned depth, int dirfd,
+				const std::vector<const char*>& names,
+				const Bulk_status_options& opts,
+				const Bulk_status_callback& fn)
+		: m_ring(ring), m_dirfd{dirfd}, m_names(names), m_opts(opts),
+		  m_fn(fn), m_slots{new Slot[depth]}
+	{
+		for (unsigned i = depth; i > 0; i--)
+		{
+			m_free.push_back(i - 1);
+			if (m_opts.head_size)
+				m_slots[i - 1].buf.reset(new char[m_opts.head_size]);
+		}
+	}
+
+	void run()
+	{
+		size_t next = 0;
+
+		try {
+			while (next < m_names.size() || m_in_flight)
+			{
+				interruption_point();
+
+				while (!m_free.empty() && next < m_names.size())
+				{
+					unsigned s = m_free.back();
+					m_free.pop_back();
+					start(s, next++);
+				}
+
+				submit(1);
+				m_ring.reap([this](__u64 data, __s32 res) {
+					complete(static_cast<unsigned>(data), res);
+				});
+			}
+		} catch (...) {
+			// The kernel may still write to the slots.
+			if (drain() != 0)
+				m_slots.release();
+
+			throw;
+		}
+	}
+
+private:
+	// Waits for the requests in flight once the query has failed or
+	// has been cancelled. Returns errno if the ring fails, the slots
+	// mustn't be freed then.
+	int drain() noexcept
+	{
+		while (m_in_flight)
+		{
+			if (int err = m_ring.submit(1))
+				return err;
+
+			m_ring.reap([this](__u64 data, __s32 res) noexcept {
+				discard(static_cast<unsigned>(data), res);
+			});
+		}
+
+		return 0;
+	}
+
+	void submit(unsigned wait_nr)
+	{
+		if (int err = m_ring.submit(wait_nr))
+			throw Filesystem_error {err};
+	}
+
+	void start(unsigned s, size_t index)
+	{
+		Slot& slot = m_slots[s];
+		slot.stage = Slot::Stage::statx;
+		slot.fd = -1;
+		slot.res = {index, 0, Stat{}, nullptr, 0, 0};
+
+		unsigned flags = AT_NO_AUTOMOUNT;
+		if (!m_opts.follow_symlinks) flags |= AT_SYMLINK_NOFOLLOW;
+		if (m_opts.fields & stat_dont_sync) flags |= AT_STATX_DONT_SYNC;
+
+		io_uring_sqe* sqe = m_ring.get_sqe();
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = m_dirfd;
+		sqe->addr = reinterpret_cast<__u64>(m_names[index]);
+		sqe->len = m_opts.fields & ~stat_dont_sync;
+		sqe->off = reinterpret_cast<__u64>(&slot.stx);
+		sqe->statx_flags = flags;
+		sqe->user_data = s;
+
+		m_in_flight++;
+	}
+
+	void queue(unsigned s, Slot::Stage stage)
+	{
+		Slot& slot = m_slots[s];
+		slot.stage = stage;
+
+		io_uring_sqe* sqe = m_ring.get_sqe();
+		sqe->user_data = s;
+
+		switch (stage)
+		{
+		case Slot::Stage::open:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = m_dirfd;
+			sqe->addr = reinterpret_cast<__u64>(m_names[slot.res.index]);
+			sqe->open_flags = open_flags(m_opts);
+			break;
+		case Slot::Stage::read:
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = slot.fd;
+			sqe->addr = reinterpret_cast<__u64>(slot.buf.get());
+			sqe->len = m_opts.head_size;
+			sqe->off = 0;
+			break;
+		case Slot::Stage::close:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = slot.fd;
+			break;
+		case Slot::Stage::statx:
+			break;
+		}
+
+		m_in_flight++;
+	}
+
+	// Cleans up after a request completed during drain().
+	void discard(unsigned s, __s32 res) noexcept
+	{
+		m_in_flight--;
+		Slot& slot = m_slots[s];
+
+		if (slot.stage == Slot::Stage::open && res >= 0)
+			close(res);
+		else if (slot.stage == Slot::Stage::read)
+			close(slot.fd);
+	}
+
+	void complete(unsigned s, __s32 res)
+	{
+		m_in_flight--;
+		Slot& slot = m_slots[s];
+
+		switch (slot.stage)
+		{
+		case Slot::Stage::statx:
+			if (res < 0)
+			{
+				slot.res.err = -res;
+				break;
+			}
+
+			slot.res.st = make_stat(slot.stx);
+			if (m_opts.head_size && S_ISREG(slot.res.st.st_mode))
+			{
+				queue(s, Slot::Stage::open);
+				return;
+			}
+
+			break;
+		case Slot::Stage::open:
+			if (res < 0)
+			{
+				slot.res.head_err = -res;
+				break;
+			}
+
+			slot.fd = res;
+			queue(s, Slot::Stage::read);
+			return;
+		case Slot::Stage::read:
+			if (res < 0)
+				slot.res.head_err = -res;
+			else
+			{
+				slot.res.head = slot.buf.get();
+				slot.res.head_len = res;
+			}
+
+			queue(s, Slot::Stage::close);
+			return;
+		case Slot::Stage::close:
+			break;
+		}
+
+		m_free.push_back(s);
+		m_fn(slot.res);
+	}
+};
+
+// Used when io_uring isn't available, the queries are done by a pool
+// of threads and the results are handed over to the calling thread.
+class Pool_query
+{
+private:
+	struct Result
+	{
+		Bulk_status_result res;
+		std::vector<char> head;
+	};
+
+	int m_dirfd;
+	const std::vector<const char*>& m_names;
+	const Bulk_status_options& m_opts;
+
+	std::atomic<size_t> m_next {0};
+	std::atomic<bool> m_stop {false};
+
+	std::mutex m_results_m;
+	std::condition_variable m_results_cv;
+	std::deque<Result> m_results;
+
+public:
+	Pool_query(int dirfd, const std::vector<const char*>& names,
+			   const Bulk_status_options& opts)
+		: m_dirfd{dirfd}, m_names(names), m_opts(opts)
+	{}
+
+	void run(unsigned threads, const Bulk_status_callback& fn)
+	{
+		std::vector<std::thread> pool;
+
+		// The threads started before one fails to start
+		// are stopped by the handler below.
+		try {
+			pool.reserve(threads);
+			for (unsigned i = 0; i < threads; i++)
+				pool.emplace_back(&Pool_query::work, this);
+
+			for (size_t done = 0; done < m_names.size();)
+			{
+				interruption_point();
+
+				std::deque<Result> results;
+				{
+					std::unique_lock<std::mutex> lk {m_results_m};
+					m_results_cv.wait_for(lk, std::chrono::milliseconds(50),
+						[this] { return !m_results.empty(); });
+					results.swap(m_results);
+				}
+
+				for (Result& r : results)
+				{
+					if (!r.head.empty())
+						r.res.head = r.head.data();
+
+					done++;
+					fn(r.res);
+				}
+			}
+		} catch (...) {
+			m_stop = true;
+			for (std::thread& t : pool)
+				t.join();
+
+			throw;
+		}
+
+		for (std::thread& t : pool)
+			t.join();
+	}
+
+private:
+	void work() noexcept
+	{
+		size_t i;
+		while (!m_stop && (i = m_next++) < m_names.size())
+		{
+			try {
+				Result r;
+				query(i, r);
+
+				std::lock_guard<std::mutex> lk {m_results_m};
+				m_results.push_back(std::move(r));
+				m_results_cv.notify_one();
+			} catch (...) {
+				// Out of memory, report the name as failed.
+				std::lock_guard<std::mutex> lk {m_results_m};
+				m_results.push_back(
+					{{i, ENOMEM, Stat{}, nullptr, 0, 0}, {}});
+				m_results_cv.notify_one();
+			}
+		}
+	}
+
+	void query(size_t i, Result& r)
+	{
+		const char* name = m_names[i];
+		r.res = {i, 0, Stat{}, nullptr, 0, 0};
+
+		r.res.st = (m_opts.follow_symlinks)
+			? status_at(m_dirfd, name, m_opts.fields, r.res.err)
+			: symlink_status_at(m_dirfd, name, m_opts.fields, r.res.err);
+
+		if (r.res.err || !m_opts.head_size || !S_ISREG(r.res.st.st_mode))
+			return;
+
+		int fd = openat(m_dirfd, name, open_flags(m_opts));
+		if (fd == -1)
+		{
+			r.res.head_err = errno;
+			return;
+		}
+
+		r.head.resize(m_opts.head_size);
+		ssize_t n = read(fd, r.head.data(), r.head.size());
+		if (n == -1)
+		{
+			r.res.head_err = errno;
+			r.head.clear();
+		}
+		else
+		{
+			r.head.resize(n);
+			r.res.head_len = n;
+		}
+
+		close(fd);
+	}
+};
+
+} // unnamed-namespace
+
+void bulk_status(int dirfd, const std::vector<const char*>& names,
+				 const Bulk_status_options& opts,
+				 const Bulk_status_callback& fn)
+{
+	if (names.empty())
+		return;
+
+	unsigned depth = std::max(1u, std::min(opts.depth, max_depth));
+	depth = static_cast<unsigned>(std::min<size_t>(depth, names.size()));
+
+	Uring ring;
+	if (ring.init(depth))
+	{
+		Uring_query query {ring, depth, dirfd, names, opts, fn};
+		query.run();
+
+		return;
+	}
+
+	Pool_query query {dirfd, names, opts};
+	query.run(std::min(depth, max_pool_threads), fn);
+}
+
+void bulk_status(const Path& dir, const std::vector<const char*>& names,
+				 const Bulk_status_options& opts,
+				 const Bulk_status_callback& fn)
+{
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+		throw Filesystem_error {dir, errno};
+
+	try {
+		bulk_status(fd, names, opts, fn);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+}
+
+} // namespace hawk
@@ -0,0 +1,400 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "Content_search.h"
+#include "Parallel_walker.h"
+#include "Result_batch.h"
+#include "Interrupt.h"
+
+namespace hawk {
+
+namespace {
+
+// Files are read in chunks of this size.
+constexpr size_t chunk_size = 256 * 1024;
+// How much of the beginning of a file is checked for NUL bytes.
+constexpr size_t binary_probe_size = 8192;
+// Longer lines are cut around the match.
+constexpr size_t max_text_length = 512;
+constexpr size_t text_lead = 128;
+
+char ascii_lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+// Finds the leftmost occurrence of any of a set of strings. A single
+// string is searched with memmem(), a set sharing its first byte
+// with memchr() and the others with a table of first bytes.
+class Literal_set
+{
+private:
+	std::vector<std::string> m_literals;
+	std::array<bool, 256> m_first {};
+	int m_common_first = -1;
+	size_t m_max_length = 0;
+
+public:
+	Literal_set(const std::vector<std::string>& literals, bool ignore_case)
+	{
+		for (const std::string& l : literals)
+		{
+			if (l.empty())
+				continue;
+
+			m_literals.push_back(l);
+			if (ignore_case)
+			{
+				for (char& c : m_literals.back())
+					c = ascii_lower(c);
+			}
+
+			unsigned char first = m_literals.back().front();
+			m_first[first] = true;
+			m_common_first = (m_literals.size() == 1
+							  || m_common_first == first) ? first : -2;
+			m_max_length = std::max(m_max_length, l.length());
+		}
+	}
+
+	bool empty() const { return m_literals.empty(); }
+	size_t max_length() const { return m_max_length; }
+
+	const char* find(const char* s, size_t n, size_t& len) const
+	{
+		if (m_literals.size() == 1)
+		{
+			len = m_literals[0].length();
+			return static_cast<const char*>(
+				memmem(s, n, m_literals[0].data(), len));
+		}
+
+		const char* end = s + n;
+		for (; s < end; s++)
+		{
+			if (m_common_first >= 0)
+			{
+				s = static_cast<const char*>(
+					memchr(s, m_common_first, end - s));
+				if (s == nullptr)
+					return nullptr;
+			}
+			else if (!m_first[static_cast<unsigned char>(*s)])
+				continue;
+
+			for (const std::string& l : m_literals)
+			{
+				if (l.front() == *s && l.length() <= size_t(end - s)
+					&& memcmp(s, l.data(), l.length()) == 0)
+				{
+					len = l.length();
+					return s;
+				}
+			}
+		}
+
+		return nullptr;
+	}
+};
+
+struct Fd
+{
+	int fd;
+	~Fd() { if (fd != -1) close(fd); }
+};
+
+// Searches the files a walking thread comes across.
+class Content_visitor
+{
+private:
+	// Where the scan of a file is.
+	struct Scan
+	{
+		const Path* path;
+		// File offset of the beginning of the buffer.
+		uintmax_t base = 0;
+		uintmax_t line = 1;
+		uintmax_t line_offset = 0;
+		// The current line has been reported already.
+		bool skip_line = false;
+		size_t hits = 0;
+	};
+
+	const Content_query* m_query;
+	const Literal_set* m_literals;
+	// Set once the calling thread has been interrupted, so that
+	// the other threads don't finish the files they're reading.
+	std::atomic<bool>* m_cancelled;
+
+	std::vector<char> m_buf;
+	// Lowered copy of m_buf if the case is ignored.
+	std::vector<char> m_lowered;
+
+	Result_batch<Content_hit> m_batch;
+
+public:
+	Content_visitor(const Content_query& query, const Literal_set& literals,
+					std::atomic<bool>& cancelled,
+					Batch_sink<Content_hit>& sink)
+		: m_query(&query), m_literals(&literals), m_cancelled(&cancelled),
+		  m_batch{sink}
+	{}
+
+	Walk_action visit(const Walk_entry& e)
+	{
+		if (e.type == DT_REG && m_query->name.matches(e.name)
+			&& !search_file(e.path()))
+			return Walk_action::stop;
+
+		if (m_query->max_depth >= 0 && e.level >= m_query->max_depth)
+			return Walk_action::skip;
+
+		return Walk_action::enter;
+	}
+
+	void error(const Path&, int) {}
+
+	// Sparse hits don't wait for the next one.
+	void leave(const Path&)
+	{
+		m_batch.flush_if_due();
+	}
+
+	void merge(Content_visitor& v)
+	{
+		v.flush();
+	}
+
+	void flush()
+	{
+		m_batch.flush();
+	}
+
+private:
+	bool cancelled()
+	{
+		try {
+			soft_interruption_point();
+			hard_interruption_point();
+		} catch (...) {
+			*m_cancelled = true;
+			throw;
+		}
+
+		return *m_cancelled;
+	}
+
+	// Returns false if the search has been cancelled.
+	bool search_file(const Path& path)
+	{
+		Fd f {open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY)};
+		if (f.fd == -1)
+			return true;
+
+		if (m_query->max_file_size != std::numeric_limits<uintmax_t>::max())
+		{
+			struct stat64 st;
+			if (fstat64(f.fd, &st) != 0
+				|| uintmax_t(st.st_size) > m_query->max_file_size)
+				return true;
+		}
+
+		posix_fadvise(f.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		bool ignore_case = m_query->ignore_case;
+		m_buf.resize(chunk_size);
+		if (ignore_case)
+			m_lowered.resize(chunk_size);
+
+		char* buf = m_buf.data();
+		char* hay = (ignore_case) ? m_lowered.data() : buf;
+
+		Scan s;
+		s.path = &path;
+		size_t len = 0;
+		bool probed = !m_query->skip_binary;
+
+		for (;;)
+		{
+			if (cancelled())
+				return false;
+
+			// Long files don't hold the hits back.
+			m_batch.flush_if_due();
+
+			ssize_t n = read(f.fd, buf + len, chunk_size - len);
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				return true;
+			}
+
+			if (ignore_case)
+			{
+				for (ssize_t i = 0; i < n; i++)
+					hay[len + i] = ascii_lower(buf[len + i]);
+			}
+
+			len += n;
+			bool eof = (n == 0);
+			if (!eof && len < chunk_size)
+				continue;
+
+			if (!probed)
+			{
+				if (memchr(buf, '\0', std::min(len, binary_probe_size)))
+					return true;
+				probed = true;
+			}
+
+			// Only complete lines are scanned unless there's no newline
+			// in the whole buffer.
+			const char* nl = (eof) ? nullptr
+				: static_cast<const char*>(memrchr(buf, '\n', len));
+			size_t end = (nl != nullptr) ? nl - buf + 1 : len;
+
+			if (!scan(s, buf, hay, end))
+				break;
+
+			// The end of an overlong line is kept in case a match
+			// crosses the end of the buffer, it can't be in there as
+			// a whole or the line would have been reported already.
+			size_t keep = len - end;
+			if (!eof && nl == nullptr && !s.skip_line)
+				keep = std::min(len, m_literals->max_length() - 1);
+
+			memmove(buf, buf + len - keep, keep);
+			if (ignore_case)
+				memmove(hay, hay + len - keep, keep);
+
+			s.base += len - keep;
+			len = keep;
+
+			if (eof)
+				break;
+		}
+
+		return true;
+	}
+
+	// Scans the first end bytes of the buffer. Returns false once the
+	// file has enough hits.
+	bool scan(Scan& s, const char* buf, const char* hay, size_t end)
+	{
+		size_t p = 0;
+		while (p < end)
+		{
+			if (s.skip_line)
+			{
+				const char* nl = static_cast<const char*>(
+					memchr(buf + p, '\n', end - p));
+				if (nl == nullptr)
+					return true;
+
+				p = nl - buf + 1;
+				s.line++;
+				s.line_offset = s.base + p;
+				s.skip_line = false;
+				continue;
+			}
+
+			size_t match_len;
+			const char* m = m_literals->find(hay + p, end - p, match_len);
+			size_t pos = (m != nullptr) ? m - hay : end;
+
+			// Count the lines up to the match.
+			for (const char* q = buf + p;
+				 (q = static_cast<const char*>(
+					 memchr(q, '\n', buf + pos - q))) != nullptr; q++)
+			{
+				s.line++;
+				s.line_offset = s.base + (q - buf) + 1;
+			}
+
+			if (m == nullptr)
+				return true;
+
+			const char* nl = static_cast<const char*>(
+				memchr(buf + pos, '\n', end - pos));
+			// The line may have started in a previous buffer.
+			size_t line_start = (s.line_offset > s.base)
+				? s.line_offset - s.base : 0;
+			size_t line_end = (nl != nullptr) ? nl - buf : end;
+
+			report(s, buf, line_start, line_end, pos, match_len);
+			if (m_query->max_hits != 0 && ++s.hits >= m_query->max_hits)
+				return false;
+
+			if (nl == nullptr)
+			{
+				s.skip_line = true;
+				return true;
+			}
+
+			p = line_end + 1;
+			s.line++;
+			s.line_offset = s.base + p;
+		}
+
+		return true;
+	}
+
+	void report(const Scan& s, const char* buf, size_t line_start,
+				size_t line_end, size_t pos, size_t len)
+	{
+		size_t start = line_start;
+		size_t end = line_end;
+		if (end - start > max_text_length)
+		{
+			if (pos - start > text_lead)
+				start = pos - text_lead;
+			end = std::min(end, start + max_text_length);
+		}
+
+		m_batch.add({*s.path, s.line, s.base + pos,
+					 std::string(buf + start, end - start),
+					 pos - start, std::min(len, end - pos)});
+	}
+};
+
+} // unnamed-namespace
+
+void search_contents(const Path& root, const Content_query& query,
+					 const Content_callback& fn)
+{
+	Literal_set literals {query.patterns, query.ignore_case};
+	if (literals.empty())
+		return;
+
+	Batch_sink<Content_hit> sink {fn};
+	std::atomic<bool> cancelled {false};
+	Content_visitor visitor = parallel_walk(root, query.walk,
+		Content_visitor{query, literals, cancelled, sink});
+	visitor.flush();
+}
+
+} // namespace hawk
@@ -21,75 +21,345 @@
 #include <cstring>
 #include <climits>
 #include <cstddef>
+#include <vector>
+#include <deque>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <new>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include "Filesystem.h"
+#include "Parallel_walker.h"
+#include "Interrupt.h"
 
 namespace hawk {
 
 namespace {
 
-size_t dirent_buf_size()
-{
-	long name_max;
-	size_t name_end;
-
-#   if defined(HAVE_FPATHCONF) && defined(HAVE_DIRFD) \
-	   && defined(_PC_NAME_MAX)
-		name_max = fpathconf(dirfd(dirp), _PC_NAME_MAX);
-		if (name_max == -1)
-#           if defined(NAME_MAX)
-				name_max = (NAME_MAX > 255) ? NAME_MAX : 255;
-#           else
-				return static_cast<size_t>(-1);
-#           endif
-#   else
-#       if defined(NAME_MAX)
-			name_max = (NAME_MAX > 255) ? NAME_MAX : 255;
-#       else
-#           error "buffer size for readdir_r cannot be determined"
-#       endif
-#   endif
-	name_end = static_cast<size_t>(offsetof(dirent, d_name)) + name_max + 1;
-	return (name_end > sizeof(struct dirent)
-			? name_end : sizeof(struct dirent));
+int open_directory(const Path& p) noexcept
+{
+	return open(p.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+timespec to_timespec(const statx_timestamp& ts) noexcept
+{
+	timespec res;
+	res.tv_sec = ts.tv_sec;
+	res.tv_nsec = ts.tv_nsec;
+
+	return res;
+}
+
+// Kernels older than 4.11 don't have statx.
+std::atomic<bool> statx_missing {false};
+
+Stat query_status(int dirfd, const char* name, unsigned fields, int flags,
+				  int& err) noexcept
+{
+	err = 0;
+
+	if (!statx_missing.load(std::memory_order_relaxed))
+	{
+		if (fields & stat_dont_sync)
+			flags |= AT_STATX_DONT_SYNC;
+
+		struct statx stx;
+		if (statx(dirfd, name, flags, fields & ~stat_dont_sync, &stx) == 0)
+			return make_stat(stx);
+
+		if (errno != ENOSYS)
+		{
+			err = errno;
+			return Stat {};
+		}
+
+		statx_missing = true;
+	}
+
+	Stat st {};
+	if (fstatat64(dirfd, name, &st, flags & AT_SYMLINK_NOFOLLOW) == -1)
+		err = errno;
+	else
+		st.mask = STATX_BASIC_STATS;
+
+	return st;
 }
 
 } // unnamed-namespace
 
+const char* Filesystem_error::what() const noexcept
+{
+	return m_what.c_str();
+}
+
+std::string Filesystem_error::format(const Path& p, int err)
+{
+	char msg[128];
+	msg[127] = '\0';
+	const char* err_str = strerror_r(err, msg, 127);
+
+	std::string what;
+	if (!p.empty())
+	{
+		what = p.string();
+		what += ": ";
+	}
+
+	what += err_str;
+
+	return what;
+}
+
+Directory_iterator::Dir_state* Directory_iterator::acquire_state(
+		int fd) noexcept
+{
+	Dir_state* dir = nullptr;
+	std::vector<Dir_state*>* cache = state_cache();
+
+	if (cache && !cache->empty())
+	{
+		dir = cache->back();
+		cache->pop_back();
+	}
+	else
+	{
+		dir = new (std::nothrow) Dir_state;
+		if (dir == nullptr)
+		{
+			close(fd);
+			return nullptr;
+		}
+	}
+
+	dir->fd = fd;
+	dir->off = dir->len = 0;
+	dir->ent = nullptr;
+	dir->pos = dir->next = 0;
+
+	return dir;
+}
+
+void Directory_iterator::Dir_release::operator()(Dir_state* dir) const noexcept
+{
+	close(dir->fd);
+
+	std::vector<Dir_state*>* cache = state_cache();
+	if (cache && cache->size() < max_cached_states)
+	{
+		try {
+			cache->push_back(dir);
+			return;
+		} catch (...) {}
+	}
+
+	delete dir;
+}
+
+std::vector<Directory_iterator::Dir_state*>*
+Directory_iterator::state_cache() noexcept
+{
+	// Trivially destructible, so it can be checked even after
+	// the cache's destructor has run.
+	static thread_local bool destroyed = false;
+	if (destroyed)
+		return nullptr;
+
+	// One state per level of a typical walk, the states are freed
+	// when the thread exits.
+	struct Cache
+	{
+		std::vector<Dir_state*> states;
+		~Cache()
+		{
+			for (Dir_state* d : states) delete d;
+			destroyed = true;
+		}
+	};
+
+	static thread_local Cache cache;
+	return &cache.states;
+}
+
+void Directory_iterator::Dir_state::seek(long p) noexcept
+{
+	lseek(fd, p, SEEK_SET);
+	off = len = 0;
+	ent = nullptr;
+	pos = next = p;
+}
+
+bool Directory_iterator::Dir_state::read(int& err) noexcept
+{
+	err = 0;
+
+	if (off >= len)
+	{
+		long n = syscall(SYS_getdents64, fd, buf, buf_size);
+
+		if (n <= 0)
+		{
+			if (n < 0) err = errno;
+			return false;
+		}
+
+		off = 0;
+		len = static_cast<size_t>(n);
+	}
+
+	ent = reinterpret_cast<dirent64*>(buf + off);
+	off += ent->d_reclen;
+	pos = next;
+	next = ent->d_off;
+
+	return true;
+}
+
 Directory_iterator::Directory_iterator(const Path& p)
 {
-	DIR* d = opendir(p.c_str());
+	int err;
+	int fd = open_directory(p);
 
-	if (d == nullptr)
+	if (fd == -1)
 		throw Filesystem_error {p, errno};
 
-	m_dir = std::make_shared<Dir_guard>();
-	m_dir->d = d;
-	m_dir->ent = reinterpret_cast<dirent*>(new char[dirent_buf_size()]);
+	m_dir.reset(acquire_state(fd));
+	if (!m_dir)
+		throw Filesystem_error {p, ENOMEM};
 
-	operator++();
+	increment(err);
+	if (err)
+		throw Filesystem_error {p, err};
 }
 
-Directory_iterator& Directory_iterator::operator++()
+Directory_iterator::Directory_iterator(const Path& p, int& err)
 {
-	if (m_dir)
+	int fd = open_directory(p);
+
+	if (fd == -1)
+	{
+		err = errno;
+		return;
+	}
+
+	m_dir.reset(acquire_state(fd));
+	if (!m_dir)
+	{
+		err = ENOMEM;
+		return;
+	}
+
+	increment(err);
+}
+
+Directory_iterator Directory_iterator::clone() const
+{
+	int err;
+	Directory_iterator it = clone(err);
+
+	if (err)
+		throw Filesystem_error {err};
+
+	return it;
+}
+
+Directory_iterator Directory_iterator::clone(int& err) const noexcept
+{
+	Directory_iterator it;
+	err = 0;
+
+	if (!m_dir)
+		return it;
+
+	int fd = openat(m_dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		err = errno;
+		return it;
+	}
+
+	it.m_dir.reset(acquire_state(fd));
+	if (!it.m_dir)
+	{
+		err = ENOMEM;
+		return it;
+	}
+
+	it.m_dir->seek(m_dir->pos);
+	it.increment(err);
+
+	return it;
+}
+
+Directory_iterator::Directory_iterator(const Path& p, long pos,
+									   const char* name, int& err)
+	: Directory_iterator{p, err}
+{
+	if (err || !m_dir)
+		return;
+
+	m_dir->seek(pos);
+	increment(err);
+
+	if (err || !m_dir || strcmp(m_dir->ent->d_name, name) == 0)
+		return;
+
+	// The position is stale (e.g. entries have been added or removed),
+	// look the entry up by its name.
+	m_dir->seek(0);
+
+	while (m_dir->read(err))
+	{
+		if (strcmp(m_dir->ent->d_name, name) == 0)
+			return;
+	}
+
+	if (err)
 	{
-		dirent* ent;
-		if (readdir_r(m_dir->d, m_dir->ent, &ent) != 0)
-			throw Filesystem_error {errno};
+		m_dir.reset();
+		return;
+	}
+
+	// The entry no longer exists.
+	m_dir->seek(pos);
+	increment(err);
+}
+
+Directory_iterator& Directory_iterator::operator++()
+{
+	int err;
+	increment(err);
+
+	if (err)
+		throw Filesystem_error {err};
+
+	return *this;
+}
+
+Directory_iterator& Directory_iterator::increment(int& err) noexcept
+{
+	err = 0;
 
-		if (ent == nullptr)
+	while (m_dir)
+	{
+		if (!m_dir->read(err))
 		{
 			m_dir.reset();
-			return *this;
+			break;
 		}
 
-		if (strcmp(ent->d_name, ".") == 0
-			|| strcmp(ent->d_name, "..") == 0)
-			operator++();
+		const char* name = m_dir->ent->d_name;
+		if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+			break;
 	}
 
 	return *this;
@@ -106,6 +376,43 @@ Path Directory_iterator::operator*() const
 	return (m_dir) ? Path{m_dir->ent->d_name} : Path{};
 }
 
+const char* Directory_iterator::name() const
+{
+	return (m_dir) ? m_dir->ent->d_name : "";
+}
+
+unsigned char Directory_iterator::type() const
+{
+	int err;
+	unsigned char t = type(err);
+
+	if (err)
+		throw Filesystem_error {operator*(), err};
+
+	return t;
+}
+
+unsigned char Directory_iterator::type(int& err) const noexcept
+{
+	err = 0;
+	if (!m_dir) return DT_UNKNOWN;
+
+	dirent64* ent = m_dir->ent;
+	if (ent->d_type != DT_UNKNOWN)
+		return ent->d_type;
+
+	struct stat st;
+	if (fstatat(m_dir->fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+	{
+		err = errno;
+		return DT_UNKNOWN;
+	}
+
+	// Remember it for subsequent calls.
+	ent->d_type = IFTODT(st.st_mode);
+	return ent->d_type;
+}
+
 bool Directory_iterator::operator==(const Directory_iterator& it) const
 {
 	if (!m_dir && !it.m_dir) return true;
@@ -124,20 +431,40 @@ bool Directory_iterator::at_end() const
 	return !m_dir;
 }
 
+long Directory_iterator::tell() const
+{
+	return (m_dir) ? m_dir->pos : -1;
+}
+
 /// end of Directory_iterator implementation
 
 Path Recursive_directory_iterator::operator*() const
 {
-	Path p;
-	for (const auto& leaf : m_iter_stack)
-		p /= *leaf.second;
-
-	return p;
+	return Path{relative_path()};
 }
 
 Path Recursive_directory_iterator::top() const
 {
-	return *m_iter_stack.back().second;
+	return Path{m_iter_stack.back().second.name()};
+}
+
+const char* Recursive_directory_iterator::relative_path() const
+{
+	if (m_iter_stack.empty())
+		return "";
+
+	const char* rel = m_path.c_str() + m_root_len;
+	return (*rel == '/') ? rel + 1 : rel;
+}
+
+unsigned char Recursive_directory_iterator::type() const
+{
+	return m_iter_stack.back().second.type();
+}
+
+unsigned char Recursive_directory_iterator::type(int& err) const noexcept
+{
+	return m_iter_stack.back().second.type(err);
 }
 
 int Recursive_directory_iterator::level() const
@@ -169,28 +496,158 @@ bool Recursive_directory_iterator::at_end() const
 }
 
 Recursive_directory_iterator::Recursive_directory_iterator(const Path& p)
+	: m_path{p}, m_root_len{p.length()}
 {
-	m_iter_stack.emplace_back(p, Directory_iterator {p});
+	push(Directory_iterator {p});
+	if (m_iter_stack.back().second.at_end())
+		m_iter_stack.clear();
+
+	update_path();
+}
+
+Recursive_directory_iterator::Recursive_directory_iterator(
+		const Path& p, int& err)
+	: m_path{p}, m_root_len{p.length()}
+{
+	Directory_iterator it {p, err};
+	if (!err && !it.at_end())
+		push(std::move(it));
+
+	update_path();
+}
+
+Recursive_directory_iterator::Recursive_directory_iterator(
+		const Checkpoint& cp)
+{
+	int err;
+	Path failed;
+	restore(cp, err, failed);
+
+	if (err)
+		throw Filesystem_error {failed, err};
+}
+
+Recursive_directory_iterator::Recursive_directory_iterator(
+		const Checkpoint& cp, int& err)
+{
+	Path failed;
+	restore(cp, err, failed);
+}
+
+Recursive_directory_iterator Recursive_directory_iterator::clone() const
+{
+	int err;
+	Recursive_directory_iterator it = clone(err);
+
+	if (err)
+		throw Filesystem_error {m_path, err};
+
+	return it;
+}
+
+Recursive_directory_iterator
+Recursive_directory_iterator::clone(int& err) const
+{
+	Recursive_directory_iterator it;
+	err = 0;
+
+	for (const auto& leaf : m_iter_stack)
+	{
+		Directory_iterator dir = leaf.second.clone(err);
+		if (err)
+		{
+			it.m_iter_stack.clear();
+			return it;
+		}
+
+		it.m_iter_stack.emplace_back(leaf.first, std::move(dir));
+	}
+
+	it.m_path = m_path;
+	it.m_root_len = m_root_len;
+
+	return it;
+}
+
+Recursive_directory_iterator::Checkpoint
+Recursive_directory_iterator::checkpoint() const
+{
+	Checkpoint cp;
+	if (m_iter_stack.empty())
+		return cp;
+
+	cp.root = Path{m_path.c_str(), m_root_len};
+	cp.levels.reserve(m_iter_stack.size());
+
+	for (const auto& leaf : m_iter_stack)
+	{
+		const Directory_iterator& it = leaf.second;
+		cp.levels.push_back({it.tell(), it.name()});
+	}
+
+	return cp;
+}
+
+void Recursive_directory_iterator::restore(
+		const Checkpoint& cp, int& err, Path& failed)
+{
+	err = 0;
+	m_iter_stack.clear();
+	m_path = cp.root;
+	m_root_len = m_path.length();
+
+	for (const Checkpoint::Level& l : cp.levels)
+	{
+		// m_path is the directory of this level here.
+		Directory_iterator it {m_path, l.pos, l.name.c_str(), err};
+		if (err)
+		{
+			m_iter_stack.clear();
+			failed = std::move(m_path);
+			m_path.clear();
+
+			return;
+		}
+
+		if (it.at_end())
+		{
+			// Everything from this entry on has been removed,
+			// continue with the parent directory.
+			int inc_err;
+			orthogonal_increment(inc_err);
+
+			break;
+		}
+
+		bool same_entry = strcmp(it.name(), l.name.c_str()) == 0;
+		push(std::move(it));
+		update_path();
+
+		// We've ended up at a different entry, the deeper
+		// levels don't belong to it.
+		if (!same_entry)
+			break;
+	}
+
+	if (m_iter_stack.empty())
+		m_path.clear();
 }
 
 void Recursive_directory_iterator::leave_directory()
 {
 	if (!m_iter_stack.empty())
+	{
 		m_iter_stack.pop_back();
+		update_path();
+	}
 }
 
 Recursive_directory_iterator& Recursive_directory_iterator::operator++()
 {
 	if (m_iter_stack.empty()) return *this;
 
-	auto& back = m_iter_stack.back();
-	Path parent_path =  back.first / *back.second;
-
-	if (is_directory(parent_path))
-	{
-		m_iter_stack.emplace_back(
-					parent_path, Directory_iterator {parent_path});
-	}
+	if (m_iter_stack.back().second.type() == DT_DIR)
+		push(Directory_iterator {m_path});
 	else
 		increment();
 
@@ -211,6 +668,51 @@ Recursive_directory_iterator::orthogonal_increment()
 	return *this;
 }
 
+Recursive_directory_iterator&
+Recursive_directory_iterator::increment(int& err)
+{
+	err = 0;
+	if (m_iter_stack.empty()) return *this;
+
+	if (m_iter_stack.back().second.type(err) == DT_DIR)
+	{
+		Directory_iterator dir {m_path, err};
+
+		if (!err)
+		{
+			push(std::move(dir));
+
+			int res_err;
+			resolve_empty_directories(res_err);
+			return *this;
+		}
+	}
+
+	// Either a regular file or a sub-directory we cannot enter.
+	int inc_err;
+	orthogonal_increment(inc_err);
+	if (!err) err = inc_err;
+
+	return *this;
+}
+
+Recursive_directory_iterator&
+Recursive_directory_iterator::orthogonal_increment(int& err)
+{
+	err = 0;
+
+	if (!m_iter_stack.empty())
+	{
+		m_iter_stack.back().second.increment(err);
+
+		int res_err;
+		resolve_empty_directories(res_err);
+		if (!err) err = res_err;
+	}
+
+	return *this;
+}
+
 void Recursive_directory_iterator::advance(
 		const Recursive_directory_iterator& target)
 {
@@ -218,6 +720,24 @@ void Recursive_directory_iterator::advance(
 		operator++();
 }
 
+void Recursive_directory_iterator::push(Directory_iterator&& it)
+{
+	m_iter_stack.emplace_back(m_path.length(), std::move(it));
+}
+
+void Recursive_directory_iterator::update_path()
+{
+	if (m_iter_stack.empty())
+	{
+		m_path.clear();
+		return;
+	}
+
+	const auto& back = m_iter_stack.back();
+	m_path.truncate(back.first);
+	m_path /= back.second.name();
+}
+
 void Recursive_directory_iterator::resolve_empty_directories()
 {
 	while (m_iter_stack.back().second.at_end())
@@ -226,6 +746,25 @@ void Recursive_directory_iterator::resolve_empty_directories()
 		if (m_iter_stack.empty()) break;
 		increment();
 	}
+
+	update_path();
+}
+
+void Recursive_directory_iterator::resolve_empty_directories(int& err)
+{
+	err = 0;
+
+	while (m_iter_stack.back().second.at_end())
+	{
+		m_iter_stack.pop_back();
+		if (m_iter_stack.empty()) break;
+
+		int inc_err;
+		m_iter_stack.back().second.increment(inc_err);
+		if (!err) err = inc_err;
+	}
+
+	update_path();
 }
 
 /// end of Recursive_directory_iterator implementation
@@ -239,40 +778,85 @@ bool exists(const Path& p)
 
 Stat status(const Path& p)
 {
-	Stat st;
-	if (stat64(p.c_str(), &st) == -1)
-		throw Filesystem_error {p, errno};
-
-	return st;
+	return status(p, stat_basic);
 }
 
 Stat status(const Path& p, int& err) noexcept
 {
-	Stat st;
-	if (stat64(p.c_str(), &st) == -1)
-		err = errno;
-	else
-		err = 0;
+	return status(p, stat_basic, err);
+}
+
+Stat status(const Path& p, unsigned fields)
+{
+	int err;
+	Stat st = status(p, fields, err);
+	if (err)
+		throw Filesystem_error {p, err};
 
 	return st;
 }
 
+Stat status(const Path& p, unsigned fields, int& err) noexcept
+{
+	return query_status(AT_FDCWD, p.c_str(), fields, 0, err);
+}
+
 Stat symlink_status(const Path& p)
 {
-	Stat st;
-	if (lstat64(p.c_str(), &st) == -1)
-		throw Filesystem_error {p, errno};
+	return symlink_status(p, stat_basic);
+}
+
+Stat symlink_status(const Path& p, int& err) noexcept
+{
+	return symlink_status(p, stat_basic, err);
+}
+
+Stat symlink_status(const Path& p, unsigned fields)
+{
+	int err;
+	Stat st = symlink_status(p, fields, err);
+	if (err)
+		throw Filesystem_error {p, err};
 
 	return st;
 }
 
-Stat symlink_status(const Path& p, int& err) noexcept
+Stat symlink_status(const Path& p, unsigned fields, int& err) noexcept
 {
-	Stat st;
-	if (lstat64(p.c_str(), &st) == -1)
-		err = errno;
-	else
-		err = 0;
+	return query_status(AT_FDCWD, p.c_str(), fields, AT_SYMLINK_NOFOLLOW,
+						err);
+}
+
+Stat status_at(int dirfd, const char* name, unsigned fields,
+			   int& err) noexcept
+{
+	return query_status(dirfd, name, fields, 0, err);
+}
+
+Stat symlink_status_at(int dirfd, const char* name, unsigned fields,
+					   int& err) noexcept
+{
+	return query_status(dirfd, name, fields, AT_SYMLINK_NOFOLLOW, err);
+}
+
+Stat make_stat(const struct statx& stx) noexcept
+{
+	Stat st {};
+	st.mask = stx.stx_mask;
+	st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+	st.st_ino = stx.stx_ino;
+	st.st_mode = stx.stx_mode;
+	st.st_nlink = stx.stx_nlink;
+	st.st_uid = stx.stx_uid;
+	st.st_gid = stx.stx_gid;
+	st.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+	st.st_size = stx.stx_size;
+	st.st_blksize = stx.stx_blksize;
+	st.st_blocks = stx.stx_blocks;
+	st.st_atim = to_timespec(stx.stx_atime);
+	st.st_mtim = to_timespec(stx.stx_mtime);
+	st.st_ctim = to_timespec(stx.stx_ctime);
+	st.st_btim = to_timespec(stx.stx_btime);
 
 	return st;
 }
@@ -299,7 +883,7 @@ bool is_writable(const Stat& st) noexcept
 
 bool is_directory(const Path& p)
 {
-	return S_ISDIR(status(p).st_mode);
+	return S_ISDIR(status(p, stat_type).st_mode);
 }
 
 bool is_directory(const Stat& st) noexcept
@@ -309,7 +893,7 @@ bool is_directory(const Stat& st) noexcept
 
 bool is_regular_file(const Path& p)
 {
-	return S_ISREG(status(p).st_mode);
+	return S_ISREG(status(p, stat_type).st_mode);
 }
 
 bool is_regular_file(const Stat& st) noexcept
@@ -319,7 +903,7 @@ bool is_regular_file(const Stat& st) noexcept
 
 bool is_symlink(const Path& p)
 {
-	return S_ISLNK(status(p).st_mode);
+	return S_ISLNK(symlink_status(p, stat_type).st_mode);
 }
 
 bool is_symlink(const Stat& st) noexcept
@@ -329,7 +913,7 @@ bool is_symlink(const Stat& st) noexcept
 
 uintmax_t file_size(const Path& p)
 {
-	return status(p).st_size;
+	return status(p, stat_size).st_size;
 }
 
 uintmax_t file_size(const Stat& st) noexcept
@@ -339,23 +923,25 @@ uintmax_t file_size(const Stat& st) noexcept
 
 time_t last_write_time(const Path& p)
 {
-	return status(p).st_ctim.tv_sec;
+	return status(p, stat_mtime).st_mtim.tv_sec;
 }
 
 time_t last_write_time(const Path& p, int& err) noexcept
 {
-	Stat st;
-	if (stat64(p.c_str(), &st) == -1)
-	{
-		err = errno;
-		return -1;
-	}
-
-	err = 0;
+	Stat st = status(p, stat_mtime, err);
+	return (err) ? -1 : st.st_mtim.tv_sec;
+}
 
+time_t last_write_time(const Stat& st) noexcept
+{
 	return st.st_mtim.tv_sec;
 }
 
+time_t creation_time(const Stat& st) noexcept
+{
+	return (st.mask & STATX_BTIME) ? st.st_btim.tv_sec : -1;
+}
+
 Path canonical(const Path& p, const Path& base)
 {
 	char buf[PATH_MAX];
@@ -425,6 +1011,98 @@ Space_info space(const Path& p)
 			 stvfs.f_bavail * stvfs.f_frsize };
 }
 
+Space_info space(const Path& p, int& err) noexcept
+{
+	struct statvfs64 stvfs;
+	if (statvfs64(p.c_str(), &stvfs) != 0)
+	{
+		err = errno;
+		return {0, 0, 0};
+	}
+
+	err = 0;
+	return { stvfs.f_blocks * stvfs.f_frsize,
+			 stvfs.f_bfree  * stvfs.f_frsize,
+			 stvfs.f_bavail * stvfs.f_frsize };
+}
+
+const Stat& File_entry::stat(unsigned fields)
+{
+	int err;
+	stat(fields, err);
+	if (err)
+		throw Filesystem_error {m_path, err};
+
+	return m_st;
+}
+
+const Stat& File_entry::stat(unsigned fields, int& err) noexcept
+{
+	unsigned wanted = fields & ~stat_dont_sync;
+	if (m_err || (m_fields & wanted) == wanted)
+	{
+		err = m_err;
+		return m_st;
+	}
+
+	// Fetch the fields we have as well, so that they all come
+	// from the same snapshot.
+	fields |= m_fields;
+	Stat st = (m_follow) ? status(m_path, fields, err)
+						 : symlink_status(m_path, fields, err);
+
+	if (err)
+		m_err = err;
+	else
+	{
+		m_st = st;
+		m_fields |= wanted | st.mask;
+	}
+
+	return m_st;
+}
+
+bool File_entry::exists() noexcept
+{
+	int err;
+	stat(stat_type, err);
+
+	return !err;
+}
+
+bool File_entry::is_directory()
+{
+	return S_ISDIR(stat(stat_type).st_mode);
+}
+
+bool File_entry::is_directory(int& err) noexcept
+{
+	const Stat& st = stat(stat_type, err);
+	return !err && S_ISDIR(st.st_mode);
+}
+
+bool File_entry::is_regular_file()
+{
+	return S_ISREG(stat(stat_type).st_mode);
+}
+
+bool File_entry::is_regular_file(int& err) noexcept
+{
+	const Stat& st = stat(stat_type, err);
+	return !err && S_ISREG(st.st_mode);
+}
+
+bool File_entry::is_symlink()
+{
+	return S_ISLNK(stat(stat_type).st_mode);
+}
+
+bool File_entry::is_symlink(int& err) noexcept
+{
+	const Stat& st = stat(stat_type, err);
+	return !err && S_ISLNK(st.st_mode);
+}
+
 // operational functions
 
 void create_directory(const Path& p)
@@ -503,7 +1181,7 @@ void create_symlink(const Path& target,
 
 int read_permissions(const Path& p)
 {
-	return status(p).st_mode;
+	return status(p, stat_mode).st_mode;
 }
 
 int read_permissions(const Stat& st) noexcept
@@ -531,6 +1209,28 @@ void copy_permissions(const Path& from, const Path& to)
 		throw Filesystem_error {to, errno};
 }
 
+void copy_permissions(const Path& from, const Path& to, int& err) noexcept
+{
+	Stat st = status(from, err);
+	if (err) return;
+
+	write_permissions(to, st.st_mode, err);
+}
+
+void copy_permissions(File_entry& from, const Path& to)
+{
+	if (chmod(to.c_str(), from.stat(stat_mode).st_mode) != 0)
+		throw Filesystem_error {to, errno};
+}
+
+void copy_permissions(File_entry& from, const Path& to, int& err) noexcept
+{
+	const Stat& st = from.stat(stat_mode, err);
+	if (err) return;
+
+	write_permissions(to, st.st_mode, err);
+}
+
 void remove_file(const Path& p)
 {
 	if (unlink(p.c_str()) != 0)
@@ -570,36 +1270,191 @@ void remove_ndirectories(int count, Path&& directory)
 
 void remove_recursively(const Path& dir)
 {
-	Path prev_path;
-	int prev_level = 0;
+	// Directories we've entered, the innermost one being the last.
+	std::vector<Path> dirs;
 
 	Recursive_directory_iterator it {dir};
 	while (!it.at_end())
 	{
-		if (prev_level > it.level())
-		{
-			// We've left a directory/directories which means
-			// they're now empty and should be safe to remove.
-			remove_ndirectories(
-						prev_level - it.level() - 1, std::move(prev_path));
-		}
+		// We've left these directories which means they're
+		// now empty and should be safe to remove.
+		for (; static_cast<int>(dirs.size()) > it.level(); dirs.pop_back())
+			remove_directory(dirs.back());
 
 		Path p = dir / *it;
 		Stat st = symlink_status(p);
-		prev_level = it.level();
 
-		if (is_symlink(st))
-			it.orthogonal_increment(); // Don't iterate through symlinks.
-		else
+		if (is_directory(st))
+		{
+			dirs.push_back(std::move(p));
 			++it;
-
-		if (!is_directory(st))
-			remove_file(p);
+		}
 		else
-			prev_path = std::move(p);
+		{
+			it.orthogonal_increment(); // Don't iterate through symlinks.
+			remove_file(p);
+		}
+	}
+
+	for (; !dirs.empty(); dirs.pop_back())
+		remove_directory(dirs.back());
+
+	remove_directory(dir);
+}
+
+unsigned _walk_threads(const Walk_options& opts)
+{
+	if (opts.threads != 0)
+		return opts.threads;
+
+	unsigned n = std::thread::hardware_concurrency();
+	return (n != 0) ? n : 1;
+}
+
+// Walk_scheduler implementation
+
+int Walk_scheduler::start(const Path& root) noexcept
+{
+	if (m_opts.same_filesystem
+		|| m_opts.symlinks == Walk_options::Symlinks::follow)
+	{
+		int err;
+		Stat st = status(root, err);
+		if (err)
+			return err;
+
+		m_root_dev = st.st_dev;
+		try { m_visited.emplace(st.st_dev, st.st_ino); }
+		catch (const std::bad_alloc&) { return ENOMEM; }
+	}
+
+	try { push(0, {root, 0}); }
+	catch (const std::bad_alloc&) { return ENOMEM; }
+
+	return 0;
+}
+
+bool Walk_scheduler::next(unsigned w, Job& job)
+{
+	while (!m_stop)
+	{
+		interruption_point(w);
+
+		if (pop(w, job) || steal(w, job))
+			return true;
+
+		if (m_pending == 0)
+			break;
+
+		// Another thread is still reading and may queue
+		// more directories.
+		std::unique_lock<std::mutex> lk {m_idle_m};
+		m_idle_cv.wait_for(lk, std::chrono::milliseconds(5));
+	}
+
+	return false;
+}
+
+void Walk_scheduler::done() noexcept
+{
+	if (--m_pending == 0)
+		m_idle_cv.notify_all();
+}
+
+void Walk_scheduler::push(unsigned w, Job&& job)
+{
+	m_pending++;
+	{
+		std::lock_guard<std::mutex> lk {m_queues[w].m};
+		m_queues[w].jobs.push_back(std::move(job));
+	}
+
+	m_idle_cv.notify_one();
+}
+
+bool Walk_scheduler::may_enter(const Path& p, int& err)
+{
+	err = 0;
+	if (!m_opts.same_filesystem
+		&& m_opts.symlinks == Walk_options::Symlinks::no_follow)
+		return true;
+
+	Stat st = status(p, err);
+	if (err)
+		return false;
+
+	if (m_opts.same_filesystem && st.st_dev != m_root_dev)
+		return false;
+
+	if (m_opts.symlinks == Walk_options::Symlinks::follow)
+	{
+		std::lock_guard<std::mutex> lk {m_visited_m};
+		return m_visited.emplace(st.st_dev, st.st_ino).second;
+	}
+
+	return true;
+}
+
+void Walk_scheduler::stop() noexcept
+{
+	m_stop = true;
+	m_idle_cv.notify_all();
+}
+
+void Walk_scheduler::fail(std::exception_ptr e) noexcept
+{
+	{
+		std::lock_guard<std::mutex> lk {m_exception_m};
+		if (!m_exception)
+			m_exception = e;
+	}
+
+	stop();
+}
+
+void Walk_scheduler::rethrow()
+{
+	if (m_exception)
+		std::rethrow_exception(m_exception);
+}
+
+void Walk_scheduler::interruption_point(unsigned w)
+{
+	if (w == 0)
+	{
+		soft_interruption_point();
+		hard_interruption_point();
+	}
+}
+
+bool Walk_scheduler::pop(unsigned w, Job& job)
+{
+	Queue& q = m_queues[w];
+	std::lock_guard<std::mutex> lk {q.m};
+	if (q.jobs.empty())
+		return false;
+
+	job = std::move(q.jobs.back());
+	q.jobs.pop_back();
+	return true;
+}
+
+bool Walk_scheduler::steal(unsigned w, Job& job)
+{
+	size_t n = m_queues.size();
+	for (size_t i = 1; i < n; i++)
+	{
+		Queue& q = m_queues[(w + i) % n];
+		std::lock_guard<std::mutex> lk {q.m};
+		if (q.jobs.empty())
+			continue;
+
+		job = std::move(q.jobs.front());
+		q.jobs.pop_front();
+		return true;
 	}
 
-	remove_ndirectories(prev_level, std::move(prev_path));
+	return false;
 }
 
 } // namespace hawk
@@ -20,16 +20,62 @@
 #include <cstdio>
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <memory>
+#include <tuple>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include "Interruptible_thread.h"
 #include "Filesystem.h"
 #include "IO_tasking.h"
+#include "Tree_walker.h"
 
 namespace hawk {
 
 using Time_point = std::chrono::steady_clock::time_point;
 
+// The number of per-entry progress events an IO task can hold.
+constexpr size_t progress_ring_capacity = 1024;
+
+// Durability::batched and Cache_mode::drop_behind start the writeback
+// of a file being copied each time this many bytes have been written.
+constexpr off64_t writeback_window = 8 * 1024 * 1024;
+
+// Cache_mode::direct bypasses the page cache only for files at least
+// this large, smaller ones are copied in the drop_behind mode.
+constexpr uintmax_t direct_io_threshold = 64 * 1024 * 1024;
+constexpr size_t direct_io_alignment = 4096;
+constexpr size_t direct_io_buf_sz = 1024 * 1024;
+
+// Files smaller than this are written to multiple destinations
+// sequentially rather than by a thread per destination.
+constexpr uintmax_t fanout_threshold = 1024 * 1024;
+
+// Files at least this large are copied by ranges in parallel
+// if the task has more than one range worker.
+constexpr uintmax_t range_copy_threshold = 256 * 1024 * 1024;
+constexpr uintmax_t range_sz = 32 * 1024 * 1024;
+constexpr size_t range_buf_sz = 1024 * 1024;
+
+// The most range workers and the largest buffer
+// the auto tuning may try.
+constexpr unsigned max_range_workers = 16;
+constexpr size_t max_tuned_buffer_size = 4 * 1024 * 1024;
+
+// The number of files IO_task_copy sorts by their physical location
+// at a time when the extent ordering is on.
+constexpr size_t extent_batch_size = 256;
+
+// Durability::ordered copies a file under its name with this suffix
+// and renames it once the data have reached the disk.
+constexpr char partial_suffix[] = ".hawk-part";
+
 namespace {
 
 static struct
@@ -52,13 +98,13 @@ private:
 	int m_fd;
 
 public:
-	File(const Path& file, int flags, mode_t mode)
+	File(const Path& file, int flags, mode_t mode, int& err) noexcept
 	{
 		m_fd = open64(file.c_str(), flags, mode);
-		if (m_fd == -1) throw Filesystem_error {file, errno};
+		err = (m_fd == -1) ? errno : 0;
 	}
 
-	~File() { close(m_fd); }
+	~File() { if (m_fd != -1) close(m_fd); }
 
 	int get_fd() const noexcept { return m_fd; }
 
@@ -72,6 +118,25 @@ public:
 		return ::write(m_fd, buf, sz);
 	}
 
+	// Writes the whole buffer. Returns errno on failure.
+	int write_all(const char* buf, size_t sz) noexcept
+	{
+		while (sz > 0)
+		{
+			ssize_t n = ::write(m_fd, buf, sz);
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				return errno;
+			}
+
+			buf += n;
+			sz -= n;
+		}
+
+		return 0;
+	}
+
 	void seek(off64_t offset) noexcept
 	{
 		lseek64(m_fd, offset, SEEK_SET);
@@ -81,8 +146,92 @@ public:
 	{
 		return lseek64(m_fd, 0, SEEK_CUR);
 	}
+
+	// Returns errno on failure, EINVAL if the filesystem
+	// doesn't support O_DIRECT.
+	int set_direct(bool direct) noexcept
+	{
+		int flags = fcntl(m_fd, F_GETFL);
+		if (flags == -1) return errno;
+
+		flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+		return (fcntl(m_fd, F_SETFL, flags) == -1) ? errno : 0;
+	}
 };
 
+// Keeps the writeback of a file being copied going window by window
+// and, if asked to, drops the windows already on the disk from the page
+// cache, both the source's and the destination's pages, so that a bulk
+// copy doesn't evict everything else from the cache.
+class Writeback_window
+{
+private:
+	int m_src_fd;
+	int m_dst_fd;
+	bool m_writeback;
+	bool m_drop;
+	off64_t m_prev;
+	off64_t m_start;
+
+	int drop(off64_t offset, off64_t len) noexcept
+	{
+		// Wait for the writeback started a window ago,
+		// clean pages can be dropped only.
+		if (sync_file_range(m_dst_fd, offset, len,
+							SYNC_FILE_RANGE_WAIT_BEFORE |
+							SYNC_FILE_RANGE_WRITE |
+							SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+			return errno;
+
+		posix_fadvise64(m_dst_fd, offset, len, POSIX_FADV_DONTNEED);
+		posix_fadvise64(m_src_fd, offset, len, POSIX_FADV_DONTNEED);
+
+		return 0;
+	}
+
+public:
+	Writeback_window(int src_fd, int dst_fd, off64_t offset,
+					 bool writeback, bool drop) noexcept
+		:
+		  m_src_fd{src_fd},
+		  m_dst_fd{dst_fd},
+		  m_writeback{writeback || drop},
+		  m_drop{drop},
+		  m_prev{offset},
+		  m_start{offset}
+	{}
+
+	// offset is the number of bytes written so far.
+	// Returns errno on failure (e.g. EIO of an earlier writeback).
+	int advance(off64_t offset) noexcept
+	{
+		if (!m_writeback || offset - m_start < writeback_window)
+			return 0;
+
+		if (sync_file_range(m_dst_fd, m_start, offset - m_start,
+							SYNC_FILE_RANGE_WRITE) != 0)
+			return errno;
+
+		int err = 0;
+		if (m_drop && m_start > m_prev)
+			err = drop(m_prev, m_start - m_prev);
+
+		m_prev = m_start;
+		m_start = offset;
+
+		return err;
+	}
+
+	// Called once the whole file has been written.
+	int finish() noexcept
+	{
+		// 0 length means up to the end of the file.
+		return (m_drop) ? drop(m_prev, 0) : 0;
+	}
+};
+
+// bytes_read is the number of bytes copied since start, offset is
+// the position in the file out of total_size.
 void update_progress(
 		IO_task* parent, uintmax_t bytes_read, uintmax_t offset,
 		uintmax_t total_size, const Time_point& start, Time_point& last_update)
@@ -90,17 +239,23 @@ void update_progress(
 	auto now = std::chrono::steady_clock::now();
 	if (now - last_update > std::chrono::seconds {1})
 	{
-		last_update = now;
 		std::chrono::seconds time_elapsed =
 				std::chrono::duration_cast<
 					std::chrono::seconds>(now - start);
 
+		// Nothing to estimate the rate from yet (e.g. a range copy
+		// waiting for its first chunk).
+		if (bytes_read == 0 || time_elapsed.count() == 0)
+			return;
+
+		last_update = now;
+
 		File_progress progress;
 		progress.total = total_size;
 		progress.offset = offset;
 		progress.rate = bytes_read / time_elapsed.count();
-		progress.eta_end =
-				(total_size - bytes_read) * time_elapsed / bytes_read;
+		progress.eta_end = (total_size - std::min(offset, total_size))
+				* time_elapsed / bytes_read;
 
 		s_monitor_callbacks.fmon(parent, progress);
 		last_update = now;
@@ -109,20 +264,211 @@ void update_progress(
 	}
 }
 
-void copy_file(IO_task* parent, IO_task::Context& ctx,
-			   const Path& src, const Path& dst)
+// Called once all data of a file have been written to fd.
+// Returns errno on failure.
+int sync_file(int fd, IO_task::Durability durability) noexcept
 {
-	// Prepare for copying.
+	switch (durability)
+	{
+	case IO_task::Durability::per_file:
+	case IO_task::Durability::ordered:
+		return (fdatasync(fd) != 0) ? errno : 0;
+	case IO_task::Durability::batched:
+		// Only start the writeback, the data are waited for
+		// by syncfs() at the end of the task.
+		return (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) != 0) ?
+			errno : 0;
+	default:
+		return 0;
+	}
+}
+
+// Flushes the whole filesystem p is on. Returns errno on failure.
+// p may be a file (a single file copied to a new name), any fd on
+// the filesystem will do. One which can't be opened (e.g. it doesn't
+// exist) is flushed through its directory.
+int sync_filesystem(const Path& p) noexcept
+{
+	int fd = open64(p.c_str(), O_RDONLY | O_NONBLOCK);
+	if (fd == -1)
+		fd = open64(p.parent_path().c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return errno;
+
+	int err = (syncfs(fd) != 0) ? errno : 0;
+	close(fd);
+
+	return err;
+}
+
+// Makes the entries of the directory containing p durable.
+// Returns errno on failure.
+int sync_parent_directory(const Path& p) noexcept
+{
+	int fd = open64(p.parent_path().c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1) return errno;
+
+	int err = (fsync(fd) != 0) ? errno : 0;
+	close(fd);
+
+	return err;
+}
 
-	if (exists(dst) && ctx.offset == 0)
-		throw Filesystem_error {dst, EEXIST};
+// A destination file being written by copy_file().
+struct Output
+{
+	IO_task::Copy_output& target;
+	// The path written to, differs from target.dst in the ordered mode.
+	Path path;
+	File file;
+	Writeback_window window;
+
+	Output(IO_task::Copy_output& t, const Path& p, int flags,
+		   int src_fd, off64_t offset, bool writeback, bool drop)
+		:
+		  target(t),
+		  path{p},
+		  file{p, flags, 0666, t.err},
+		  window{src_fd, file.get_fd(), offset, writeback, drop}
+	{}
+
+	bool ok() const noexcept { return target.err == 0; }
+
+	void write(const char* buf, size_t sz) noexcept
+	{
+		if (ok())
+			target.err = file.write_all(buf, sz);
+	}
+};
 
-	uintmax_t sz = file_size(src);
+} // unnamed-namespace
 
-	File src_file {src, O_RDONLY, 0440};
-	File dst_file {dst, O_WRONLY | O_CREAT, 0666};
+// Writes each block read by copy_data() to all outputs. The first output
+// is written by the calling thread, the others by a thread each
+// if parallel, so that a slow target holds back the others by a single
+// block at most. The threads are kept for the following files.
+class Fanout
+{
+private:
+	std::vector<Output*> m_outputs;
+	std::vector<std::thread> m_threads;
+	bool m_parallel;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	const char* m_buf;
+	size_t m_sz;
+	unsigned m_generation;
+	unsigned m_busy;
+	bool m_stop;
+
+	// Writes to the output at index, if the current file has one.
+	void writer(size_t index)
+	{
+		unsigned generation = 0;
+		for (;;)
+		{
+			Output* o;
+			{
+				std::unique_lock<std::mutex> lk {m_mutex};
+				m_cv.wait(lk, [&]{
+					return m_stop || m_generation != generation;
+				});
+
+				if (m_stop) return;
+				generation = m_generation;
+				if (index >= m_outputs.size())
+					continue;
 
-	if (sz == 0) return;
+				o = m_outputs[index];
+			}
+
+			o->write(m_buf, m_sz);
+
+			std::lock_guard<std::mutex> lk {m_mutex};
+			if (--m_busy == 0)
+				m_cv.notify_all();
+		}
+	}
+
+public:
+	Fanout()
+		:
+		  m_parallel{false},
+		  m_buf{nullptr},
+		  m_sz{0},
+		  m_generation{0},
+		  m_busy{0},
+		  m_stop{false}
+	{}
+
+	~Fanout()
+	{
+		{
+			std::lock_guard<std::mutex> lk {m_mutex};
+			m_stop = true;
+		}
+
+		m_cv.notify_all();
+		for (std::thread& t : m_threads)
+			t.join();
+	}
+
+	// Sets the outputs of the file to be copied.
+	void reset(std::vector<Output*> outputs, bool parallel)
+	{
+		std::lock_guard<std::mutex> lk {m_mutex};
+		m_outputs = std::move(outputs);
+		m_parallel = parallel && m_outputs.size() > 1;
+
+		if (m_parallel)
+		{
+			while (m_threads.size() + 1 < m_outputs.size())
+				m_threads.emplace_back(&Fanout::writer, this,
+									   m_threads.size() + 1);
+		}
+	}
+
+	void write(const char* buf, size_t sz)
+	{
+		if (!m_parallel)
+		{
+			for (Output* o : m_outputs)
+				o->write(buf, sz);
+
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lk {m_mutex};
+			m_buf = buf;
+			m_sz = sz;
+			m_busy = m_outputs.size() - 1;
+			++m_generation;
+		}
+
+		m_cv.notify_all();
+		m_outputs.front()->write(buf, sz);
+
+		std::unique_lock<std::mutex> lk {m_mutex};
+		m_cv.wait(lk, [&]{ return m_busy == 0; });
+	}
+
+	bool any_ok() const noexcept
+	{
+		return std::any_of(m_outputs.begin(), m_outputs.end(),
+						   [](const Output* o) { return o->ok(); });
+	}
+};
+
+namespace {
+
+// Copies sz bytes of src_file to the outputs starting at ctx.offset.
+// Returns errno on a failure concerning all the outputs.
+int copy_data(IO_task* parent, IO_task::Context& ctx, const Path& src,
+			  File& src_file, std::deque<Output>& outputs, uintmax_t sz,
+			  IO_task::Cache_mode cache_mode, Fanout& fanout)
+{
+	int err;
 
 	if (ctx.offset == 0)
 	{
@@ -136,7 +482,6 @@ void copy_file(IO_task* parent, IO_task::Context& ctx,
 		 *
 		 * TODO: uncomment this code somewhere in the future
 		 *
-		int err = 0;
 		err = posix_fallocate64(dst_file.get_fd(), 0, sz);
 
 		if (err && err != EINVAL) throw IO_task_fatal {dst, err};
@@ -145,19 +490,62 @@ void copy_file(IO_task* parent, IO_task::Context& ctx,
 	else
 	{
 		src_file.seek(ctx.offset);
-		dst_file.seek(ctx.offset);
+		for (Output& o : outputs)
+			o.file.seek(ctx.offset);
 
 		// Compensate for bytes already copied before resuming
 		// so that we'll get correct ETA and rate calculations.
 		sz -= ctx.offset;
 	}
 
-	int err = posix_fadvise64(src_file.get_fd(), ctx.offset, 0,
-							  POSIX_FADV_SEQUENTIAL);
+	err = posix_fadvise64(src_file.get_fd(), ctx.offset, 0,
+						  POSIX_FADV_SEQUENTIAL);
 	if (err) throw IO_task_fatal {src, err};
 
-	constexpr unsigned buf_sz  = 8192;
-	char buf[buf_sz];
+	// Bypass the page cache if asked to and the file is large enough
+	// and we're at an aligned offset (e.g. not resuming in the middle
+	// of a block). Fall back to dropping the pages behind if
+	// the filesystem doesn't support O_DIRECT.
+	bool direct = (cache_mode == IO_task::Cache_mode::direct &&
+				   sz >= direct_io_threshold &&
+				   ctx.offset % direct_io_alignment == 0);
+
+	std::unique_ptr<char, decltype(&free)> direct_buf {nullptr, free};
+	if (direct)
+	{
+		void* p = nullptr;
+		direct = (posix_memalign(&p, direct_io_alignment,
+								 direct_io_buf_sz) == 0);
+		direct_buf.reset(static_cast<char*>(p));
+	}
+
+	// An output whose filesystem doesn't support O_DIRECT
+	// is still written through the page cache.
+	if (direct && (direct = (src_file.set_direct(true) == 0)))
+	{
+		for (Output& o : outputs)
+			o.file.set_direct(true);
+	}
+
+	constexpr unsigned stack_buf_sz  = 8192;
+	char stack_buf[stack_buf_sz];
+
+	Buffer_tuner* buffer_tuner = parent->_get_buffer_tuner();
+	size_t buf_sz = direct ? direct_io_buf_sz :
+		(buffer_tuner) ? buffer_tuner->size() : parent->get_buffer_size();
+	std::unique_ptr<char[]> heap_buf;
+	if (!direct && buf_sz > stack_buf_sz)
+		heap_buf.reset(new char[buf_sz]);
+
+	char* buf = direct ? direct_buf.get() :
+		(heap_buf) ? heap_buf.get() : stack_buf;
+
+	std::vector<Output*> alive;
+	for (Output& o : outputs)
+		alive.push_back(&o);
+
+	fanout.reset(std::move(alive),
+				 outputs.size() > 1 && sz >= fanout_threshold);
 
 	// Set timers.
 
@@ -167,25 +555,649 @@ void copy_file(IO_task* parent, IO_task::Context& ctx,
 
 	// Commence copying!
 
-	for (;;)
+	while (fanout.any_ok())
 	{
 		off64_t read_sz = src_file.read(buf, buf_sz);
 		if (read_sz == 0)
 			break;
 
 		if (read_sz == -1)
-			throw Filesystem_error {src, errno};
+		{
+			if (errno == EINTR) continue;
+			return errno;
+		}
+
+		// A short read leaves us at an unaligned offset (at the end
+		// of the file), finish the rest through the page cache.
+		if (direct && read_sz % direct_io_alignment != 0)
+		{
+			src_file.set_direct(false);
+			for (Output& o : outputs)
+				o.file.set_direct(false);
+			direct = false;
+		}
 
-		if (dst_file.write(buf, read_sz) != read_sz)
-			throw Filesystem_error {dst, errno};
+		fanout.write(buf, read_sz);
 
 		bytes_read += read_sz;
 		ctx.offset += read_sz;
+
+		// The next file gets the buffer size tuned.
+		if (buffer_tuner && !direct)
+			buffer_tuner->update(read_sz, std::chrono::steady_clock::now());
+
+		for (Output& o : outputs)
+		{
+			if (o.ok())
+				o.target.err = o.window.advance(ctx.offset);
+		}
+
 		update_progress(parent, bytes_read, ctx.offset, sz,
 						ctx.start, last_update);
 	}
 
+	for (Output& o : outputs)
+	{
+		if (o.ok())
+			o.target.err = o.window.finish();
+	}
+
 	parent->_increment_offset(sz);
+
+	return 0;
+}
+
+// Writes the whole buffer at offset. Returns errno on failure.
+int pwrite_all(int fd, const char* buf, size_t sz, off64_t offset) noexcept
+{
+	while (sz > 0)
+	{
+		ssize_t n = pwrite64(fd, buf, sz, offset);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+			return errno;
+		}
+
+		buf += n;
+		sz -= n;
+		offset += n;
+	}
+
+	return 0;
+}
+
+// Copies a large file by ranges, each worker thread taking the next range
+// not copied yet. The ranges already copied are kept in ctx.ranges and
+// ctx.offset is the number of bytes in them, a range interrupted
+// by pause() is copied again from its beginning.
+class Range_copy
+{
+private:
+	IO_task::Context& m_ctx;
+	int m_src_fd;
+	std::deque<Output>& m_outputs;
+	uintmax_t m_size;
+	IO_task::Durability m_durability;
+	IO_task::Cache_mode m_cache_mode;
+
+	std::vector<std::thread> m_workers;
+	// The errors of the outputs, shared by the workers so that a failed
+	// output isn't written by the others. They're stored in the outputs
+	// after joining the workers.
+	std::unique_ptr<std::atomic<int>[]> m_errs;
+	std::atomic<size_t> m_next;
+	std::atomic<uintmax_t> m_copied;
+	std::atomic<unsigned> m_running;
+	std::atomic<int> m_src_err;
+	std::atomic<bool> m_stop;
+	// Workers with an index at least this high are parked.
+	std::atomic<unsigned> m_limit;
+	std::mutex m_limit_m;
+	std::condition_variable m_limit_cv;
+	uintmax_t m_done_before;
+
+	bool output_ok(size_t i) const noexcept
+	{
+		return m_errs[i].load(std::memory_order_relaxed) == 0;
+	}
+
+	// Keeps the first error of the output.
+	void output_error(size_t i, int err) noexcept
+	{
+		int none = 0;
+		m_errs[i].compare_exchange_strong(none, err);
+	}
+
+	bool all_failed() const noexcept
+	{
+		for (size_t i = 0; i < m_outputs.size(); ++i)
+		{
+			if (output_ok(i))
+				return false;
+		}
+
+		return true;
+	}
+
+	// Returns errno of the source, errors of the outputs go to m_errs.
+	int copy_range(off64_t begin, off64_t end, char* buf, bool& use_cfr)
+	{
+		off64_t offset = begin;
+		while (offset < end && !m_stop.load(std::memory_order_relaxed))
+		{
+			size_t chunk = std::min<off64_t>(end - offset, range_buf_sz);
+			ssize_t n;
+
+			// Let the filesystem copy the data itself if it can
+			// (e.g. a server-side copy on NFS).
+			if (use_cfr)
+			{
+				loff_t in = offset, out = offset;
+				n = copy_file_range(m_src_fd, &in,
+									m_outputs.front().file.get_fd(), &out,
+									chunk, 0);
+				if (n < 0)
+				{
+					if (errno == EINTR) continue;
+					if (errno == EXDEV || errno == EINVAL ||
+						errno == ENOSYS || errno == EOPNOTSUPP)
+					{
+						use_cfr = false;
+						continue;
+					}
+
+					// We can't tell whether reading or writing failed.
+					output_error(0, errno);
+					return 0;
+				}
+			}
+			else
+			{
+				n = pread64(m_src_fd, buf, chunk, offset);
+				if (n < 0)
+				{
+					if (errno == EINTR) continue;
+					return errno;
+				}
+
+				for (size_t i = 0; i < m_outputs.size(); ++i)
+				{
+					if (!output_ok(i))
+						continue;
+
+					if (int err = pwrite_all(m_outputs[i].file.get_fd(),
+											 buf, n, offset))
+						output_error(i, err);
+				}
+			}
+
+			// The file has shrunk.
+			if (n == 0)
+				break;
+
+			offset += n;
+			m_copied.fetch_add(n, std::memory_order_relaxed);
+		}
+
+		return 0;
+	}
+
+	// Same as Writeback_window, for a single range.
+	void write_back(off64_t begin, off64_t len)
+	{
+		for (size_t i = 0; i < m_outputs.size(); ++i)
+		{
+			if (!output_ok(i)) continue;
+
+			int fd = m_outputs[i].file.get_fd();
+			if (m_cache_mode != IO_task::Cache_mode::normal)
+			{
+				if (sync_file_range(fd, begin, len,
+									SYNC_FILE_RANGE_WAIT_BEFORE |
+									SYNC_FILE_RANGE_WRITE |
+									SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+					output_error(i, errno);
+				else
+					posix_fadvise64(fd, begin, len, POSIX_FADV_DONTNEED);
+			}
+			else if (m_durability == IO_task::Durability::batched &&
+					 sync_file_range(fd, begin, len,
+									 SYNC_FILE_RANGE_WRITE) != 0)
+				output_error(i, errno);
+		}
+
+		if (m_cache_mode != IO_task::Cache_mode::normal)
+			posix_fadvise64(m_src_fd, begin, len, POSIX_FADV_DONTNEED);
+	}
+
+	void work(unsigned index)
+	{
+		std::unique_ptr<char[]> buf {new char[range_buf_sz]};
+		bool use_cfr = (m_outputs.size() == 1);
+
+		for (;;)
+		{
+			if (index >= m_limit.load(std::memory_order_relaxed))
+			{
+				std::unique_lock<std::mutex> lk {m_limit_m};
+				m_limit_cv.wait(lk, [&]{
+					return index < m_limit || m_stop ||
+						   m_next.load() >= m_ctx.ranges.size();
+				});
+			}
+
+			size_t r = m_next.fetch_add(1);
+			if (r >= m_ctx.ranges.size() ||
+				m_stop.load(std::memory_order_relaxed))
+				break;
+
+			if (m_ctx.ranges[r])
+				continue;
+
+			off64_t begin = r * range_sz;
+			off64_t end = std::min<uintmax_t>(begin + range_sz, m_size);
+
+			if (int err = copy_range(begin, end, buf.get(), use_cfr))
+			{
+				m_src_err = err;
+				m_stop = true;
+				break;
+			}
+
+			if (m_stop.load(std::memory_order_relaxed) || all_failed())
+				break;
+
+			write_back(begin, end - begin);
+
+			// Each worker writes distinct elements.
+			m_ctx.ranges[r] = 1;
+		}
+
+		// The parked workers have nothing left to wait for.
+		std::lock_guard<std::mutex> lk {m_limit_m};
+		--m_running;
+		m_limit_cv.notify_all();
+	}
+
+	// Starts the workers up to m_limit which haven't been started yet.
+	void spawn()
+	{
+		while (m_workers.size() < m_limit)
+		{
+			++m_running;
+			m_workers.emplace_back(&Range_copy::work, this,
+								   static_cast<unsigned>(m_workers.size()));
+		}
+	}
+
+public:
+	// Starts the workers, more of them are started by set_workers().
+	Range_copy(IO_task::Context& ctx, int src_fd, std::deque<Output>& outputs,
+			   uintmax_t size, unsigned workers,
+			   IO_task::Durability durability, IO_task::Cache_mode cache_mode)
+		:
+		  m_ctx(ctx),
+		  m_src_fd{src_fd},
+		  m_outputs(outputs),
+		  m_size{size},
+		  m_durability{durability},
+		  m_cache_mode{cache_mode},
+		  m_errs{new std::atomic<int>[outputs.size()]},
+		  m_next{0},
+		  m_copied{0},
+		  m_running{0},
+		  m_src_err{0},
+		  m_stop{false},
+		  m_limit{std::max(workers, 1u)}
+	{
+		size_t n = (size + range_sz - 1) / range_sz;
+		if (m_ctx.ranges.size() != n)
+		{
+			m_ctx.ranges.assign(n, 0);
+			m_ctx.offset = 0;
+		}
+
+		m_done_before = done();
+
+		for (size_t i = 0; i < m_outputs.size(); ++i)
+			m_errs[i] = m_outputs[i].target.err;
+
+		spawn();
+	}
+
+	// Stops the workers when the copying is interrupted.
+	~Range_copy()
+	{
+		{
+			std::lock_guard<std::mutex> lk {m_limit_m};
+			m_stop = true;
+		}
+
+		m_limit_cv.notify_all();
+		for (std::thread& t : m_workers)
+			t.join();
+
+		for (size_t i = 0; i < m_outputs.size(); ++i)
+			m_outputs[i].target.err = m_errs[i];
+
+		m_ctx.offset = done();
+	}
+
+	bool running() const { return m_running != 0; }
+
+	// Mustn't be called by the workers.
+	void set_workers(unsigned workers)
+	{
+		workers = std::max(workers, 1u);
+		if (workers == m_limit)
+			return;
+
+		{
+			std::lock_guard<std::mutex> lk {m_limit_m};
+			m_limit = workers;
+		}
+
+		m_limit_cv.notify_all();
+		spawn();
+	}
+	uintmax_t copied() const { return m_copied; }
+	int error() const { return m_src_err; }
+	// The number of bytes copied before resuming.
+	uintmax_t done_before() const { return m_done_before; }
+
+private:
+	// Mustn't be called while the workers are running.
+	uintmax_t done() const
+	{
+		uintmax_t sz = 0;
+		for (size_t r = 0; r < m_ctx.ranges.size(); ++r)
+		{
+			if (m_ctx.ranges[r])
+				sz += std::min<uintmax_t>(range_sz, m_size - r * range_sz);
+		}
+
+		return sz;
+	}
+};
+
+// Copies src_file to the outputs with the given number of threads.
+// Returns errno on a failure concerning all the outputs.
+int copy_ranges(IO_task* parent, IO_task::Context& ctx, File& src_file,
+				std::deque<Output>& outputs, uintmax_t sz, unsigned workers,
+				IO_task::Durability durability, IO_task::Cache_mode cache_mode)
+{
+	// The tuner adjusts the number of workers as the copying goes.
+	Concurrency_tuner* tuner = parent->_get_tuner();
+	if (tuner)
+	{
+		workers = tuner->workers();
+		tuner->restart(0, std::chrono::steady_clock::now());
+	}
+
+	int err;
+	uintmax_t remaining;
+	{
+		Range_copy copy {ctx, src_file.get_fd(), outputs, sz, workers,
+						 durability, cache_mode};
+
+		// The ranges copied before resuming have been added
+		// to the task's offset already.
+		remaining = sz - copy.done_before();
+
+		ctx.start = std::chrono::steady_clock::now();
+		auto last_update = std::chrono::steady_clock::now();
+
+		while (copy.running())
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds {100});
+			hard_interruption_point();
+
+			if (tuner)
+				copy.set_workers(tuner->update(
+						copy.copied(), std::chrono::steady_clock::now()));
+
+			update_progress(parent, copy.copied(),
+							copy.done_before() + copy.copied(), sz,
+							ctx.start, last_update);
+		}
+
+		err = copy.error();
+	}
+
+	// A failed file doesn't count as copied.
+	if (!err && std::any_of(outputs.begin(), outputs.end(),
+							[](const Output& o) { return o.ok(); }))
+		parent->_increment_offset(remaining);
+
+	// The file is done, successfully or not.
+	ctx.ranges.clear();
+
+	return err;
+}
+
+// Copies src to every output whose err is 0. A failure of an output is
+// stored in its err and doesn't stop the copying to the others, so the
+// errs have to be kept while the task is paused. Returns errno on
+// a failure concerning all the outputs (e.g. reading src).
+int copy_file(IO_task* parent, IO_task::Context& ctx, const Path& src,
+			  std::vector<IO_task::Copy_output>& targets, Fanout& fanout)
+{
+	// Prepare for copying.
+
+	IO_task::Durability durability = parent->get_durability();
+	IO_task::Cache_mode cache_mode = parent->get_cache_mode();
+	bool ordered = (durability == IO_task::Durability::ordered);
+
+	// Otherwise O_EXCL fails with EEXIST by itself.
+	bool resuming = ctx.file_started();
+	if (!resuming && ordered)
+	{
+		for (IO_task::Copy_output& t : targets)
+		{
+			if (!t.err && exists(t.dst))
+				t.err = EEXIST;
+		}
+	}
+
+	int err;
+	File src_file {src, O_RDONLY, 0440, err};
+	if (err) return err;
+
+	Stat st;
+	if (fstat64(src_file.get_fd(), &st) == -1)
+		return errno;
+
+	uintmax_t sz = file_size(st);
+
+	int flags = O_WRONLY | O_CREAT;
+	if (!resuming)
+		flags |= (ordered) ? O_TRUNC : O_EXCL;
+	std::deque<Output> outputs;
+	for (IO_task::Copy_output& t : targets)
+	{
+		if (t.err) continue;
+
+		// A partially copied file (e.g. after a crash) must never be
+		// visible under its final name in the ordered mode.
+		Path path = ordered ? Path {t.dst.string() + partial_suffix} : t.dst;
+
+		outputs.emplace_back(t, path, flags, src_file.get_fd(),
+							 ctx.offset,
+							 durability == IO_task::Durability::batched,
+							 cache_mode != IO_task::Cache_mode::normal);
+		if (t.err)
+			outputs.pop_back();
+	}
+
+	if (outputs.empty())
+		return 0;
+
+	// A file which has been copied by ranges before pausing
+	// has to be finished that way.
+	unsigned workers = parent->get_range_workers();
+	Concurrency_tuner* tuner = parent->_get_tuner();
+	if (tuner)
+		workers = (tuner->settled()) ? tuner->workers()
+									 : tuner->max_workers();
+
+	bool by_ranges = !ctx.ranges.empty() ||
+					 (workers > 1 && sz >= range_copy_threshold);
+
+	if (by_ranges)
+		err = copy_ranges(parent, ctx, src_file, outputs, sz,
+						  std::max(workers, 1u), durability, cache_mode);
+	else if (sz != 0)
+		err = copy_data(parent, ctx, src, src_file, outputs, sz, cache_mode,
+						fanout);
+
+	if (err)
+		return err;
+
+	for (Output& o : outputs)
+	{
+		if (o.ok())
+			o.target.err = sync_file(o.file.get_fd(), durability);
+
+		if (o.ok() && ordered)
+		{
+			// The rename itself has to be durable too.
+			if (rename(o.path.c_str(), o.target.dst.c_str()) != 0)
+				o.target.err = errno;
+			else
+				o.target.err = sync_parent_directory(o.target.dst);
+		}
+	}
+
+	return 0;
+}
+
+// Copies src to dst. Returns errno on failure.
+int copy_file(IO_task* parent, IO_task::Context& ctx,
+			  const Path& src, const Path& dst)
+{
+	std::vector<IO_task::Copy_output> targets {{dst, 0}};
+	Fanout fanout;
+	int err = copy_file(parent, ctx, src, targets, fanout);
+
+	return (err) ? err : targets.front().err;
+}
+
+// Where a file's data start on the disk, used to order the copying.
+struct Extent_key
+{
+	dev_t dev;
+	bool physical;
+	uint64_t offset;
+
+	friend bool operator<(const Extent_key& l, const Extent_key& r)
+	{
+		return std::tie(l.dev, l.physical, l.offset) <
+			   std::tie(r.dev, r.physical, r.offset);
+	}
+};
+
+// Uses the physical offset of the file's first extent. Falls back to
+// the inode number (which tends to follow the allocation order) when
+// FIEMAP isn't supported or the extent isn't allocated yet.
+Extent_key extent_key(const Path& p) noexcept
+{
+	int fd = open64(p.c_str(), O_RDONLY | O_NOATIME);
+	if (fd == -1 && errno == EPERM)
+		fd = open64(p.c_str(), O_RDONLY);
+
+	// Let the copying itself report the error.
+	if (fd == -1)
+		return {0, false, 0};
+
+	Extent_key key {0, false, 0};
+	Stat st;
+	if (fstat64(fd, &st) == 0)
+		key = {st.st_dev, false, st.st_ino};
+
+	// Room for a single extent.
+	alignas(struct fiemap) char buf[sizeof(struct fiemap) +
+									sizeof(struct fiemap_extent)] {};
+	struct fiemap* map = reinterpret_cast<struct fiemap*>(buf);
+
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+
+	constexpr uint32_t no_location = FIEMAP_EXTENT_UNKNOWN |
+									 FIEMAP_EXTENT_DELALLOC;
+	if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 &&
+		map->fm_mapped_extents == 1 &&
+		!(map->fm_extents[0].fe_flags & no_location))
+	{
+		key.physical = true;
+		key.offset = map->fm_extents[0].fe_physical;
+	}
+
+	close(fd);
+
+	return key;
+}
+
+// Calls fn(st, path) for the entries counting into the size of the data
+// to be copied, stops the walk once fn returns false.
+template <typename Fn>
+class Size_walker
+{
+private:
+	Fn& m_fn;
+	Visited_directories& m_visited;
+
+public:
+	Size_walker(Fn& fn, Visited_directories& visited)
+		: m_fn(fn), m_visited(visited)
+	{}
+
+	void before(const Recursive_directory_iterator&) {}
+
+	Walk_action visit(const Path&, const Path& p, const Stat& st, int err)
+	{
+		// Errors are ignored here, failing entries will be reported
+		// once the task gets to process them.
+		if (err)
+			return Walk_action::skip;
+
+		if (is_symlink(st))
+			return (m_fn(st, p)) ? Walk_action::skip : Walk_action::stop;
+
+		if (is_directory(st))
+			m_visited.insert(st);
+
+		return (m_fn(st, p)) ? Walk_action::enter : Walk_action::stop;
+	}
+
+	void advanced(const Path&, int) {}
+};
+
+template <typename Fn>
+void walk_sizes(Recursive_directory_iterator& it, Visited_directories& visited,
+				Fn fn)
+{
+	Size_walker<Fn> walker {fn, visited};
+	walk_tree(it, walker);
+}
+
+// Pushes the directories it has entered below its top directory,
+// e.g. when resuming a walk. One failing to stat is pushed anyway
+// so that the levels left by the walk pop the right directories.
+void push_entered(Ancestor_directories& ancestors,
+				  const Recursive_directory_iterator& it)
+{
+	std::vector<Stat> dirs;
+	Path p = it.path().parent_path();
+	for (int level = it.level(); level > 0; level--)
+	{
+		int err;
+		dirs.push_back(status(p, stat_ino, err));
+		p.set_parent_path();
+	}
+
+	for (auto d = dirs.rbegin(); d != dirs.rend(); ++d)
+		ancestors.push(*d);
 }
 
 bool same_dev(const Stat& src, const Stat& dst)
@@ -193,10 +1205,30 @@ bool same_dev(const Stat& src, const Stat& dst)
 	return src.st_dev == dst.st_dev;
 }
 
-void rename_move(const Path& src, const Path& dst)
+int rename_move(const Path& src, const Path& dst) noexcept
 {
-	if (rename(src.c_str(), dst.c_str()) != 0)
-		throw IO_task_error {src, dst, errno};
+	return (rename(src.c_str(), dst.c_str()) != 0) ? errno : 0;
+}
+
+// Removes the directories in dirs deeper than level, i.e. the ones
+// a Recursive_directory_iterator has already left (and which are
+// thus empty). Returns errno, failed is set to the offending path.
+int remove_left_directories(std::vector<Path>& dirs, int level, Path& failed)
+{
+	int err;
+	for (; static_cast<int>(dirs.size()) > level; dirs.pop_back())
+	{
+		remove_directory(dirs.back(), err);
+		if (err)
+		{
+			failed = std::move(dirs.back());
+			dirs.pop_back();
+
+			return err;
+		}
+	}
+
+	return 0;
 }
 
 Path transform_symlink_path(
@@ -221,6 +1253,22 @@ void set_io_task_callbacks(Task_progress_monitor&& tmon,
 	s_monitor_callbacks.fmon = std::move(fmon);
 }
 
+// IO_task_error_batch implementation
+
+void IO_task_error_batch::add(const Path& src, const Path& dst, int err)
+{
+	if (errors.empty())
+		dir = src.parent_path();
+
+	errors.emplace_back(src, dst, err);
+}
+
+void IO_task_error_batch::clear()
+{
+	dir.clear();
+	errors.clear();
+}
+
 // IO_task implementation
 
 IO_task::IO_task(const Path& src, const Path& dst,
@@ -228,10 +1276,21 @@ IO_task::IO_task(const Path& src, const Path& dst,
 				 bool check_avail_space)
 	:
 	  m_dst{dst},
+	  m_dst_entry{dst},
 	  m_check_avail_space{check_avail_space},
 	  m_deref_symlinks{dereference_symlinks},
 	  m_update_symlinks{update_symlinks},
-	  m_total{0}
+	  m_total{0},
+	  m_offset{0},
+	  m_durability{Durability::none},
+	  m_cache_mode{Cache_mode::normal},
+	  m_range_workers{1},
+	  m_buffer_size{8192},
+	  m_auto_tuning{false},
+	  m_progress{progress_ring_capacity},
+	  m_progress_nth{1},
+	  m_progress_count{0},
+	  m_progress_dropped{0}
 {
 	m_items.emplace_back(src);
 	m_ctx.offset = 0;
@@ -242,10 +1301,21 @@ IO_task::IO_task(const std::vector<Path>& srcs, const Path& dst,
 				 bool check_avail_space)
 	:
 	  m_dst{dst},
+	  m_dst_entry{dst},
 	  m_check_avail_space{check_avail_space},
 	  m_deref_symlinks{dereference_symlinks},
 	  m_update_symlinks{update_symlinks},
-	  m_total{0}
+	  m_total{0},
+	  m_offset{0},
+	  m_durability{Durability::none},
+	  m_cache_mode{Cache_mode::normal},
+	  m_range_workers{1},
+	  m_buffer_size{8192},
+	  m_auto_tuning{false},
+	  m_progress{progress_ring_capacity},
+	  m_progress_nth{1},
+	  m_progress_count{0},
+	  m_progress_dropped{0}
 {
 	for (const Path& p : srcs)
 		m_items.emplace_back(p);
@@ -299,14 +1369,117 @@ uintmax_t IO_task::get_offset() const
 	return m_offset;
 }
 
+size_t IO_task::drain_progress(size_t max)
+{
+	return m_progress.consume([this](Progress_event& ev) {
+			if (s_monitor_callbacks.tmon)
+				s_monitor_callbacks.tmon(this, Task_progress {ev.src, ev.dst});
+		}, max);
+}
+
+void IO_task::set_progress_sampling(unsigned nth)
+{
+	m_progress_nth.store(nth, std::memory_order_relaxed);
+}
+
+uintmax_t IO_task::dropped_progress() const
+{
+	return m_progress_dropped.load(std::memory_order_relaxed);
+}
+
+void IO_task::set_durability(IO_task::Durability durability)
+{
+	m_durability = durability;
+}
+
+IO_task::Durability IO_task::get_durability() const
+{
+	return m_durability;
+}
+
+void IO_task::set_cache_mode(IO_task::Cache_mode cache_mode)
+{
+	m_cache_mode = cache_mode;
+}
+
+IO_task::Cache_mode IO_task::get_cache_mode() const
+{
+	return m_cache_mode;
+}
+
+void IO_task::set_range_workers(unsigned workers)
+{
+	m_range_workers = workers;
+}
+
+unsigned IO_task::get_range_workers() const
+{
+	return m_range_workers;
+}
+
+void IO_task::set_buffer_size(size_t size)
+{
+	m_buffer_size = std::max<size_t>(size, 512);
+}
+
+size_t IO_task::get_buffer_size() const
+{
+	return m_buffer_size;
+}
+
+void IO_task::set_auto_tuning(bool enable)
+{
+	m_auto_tuning = enable;
+	if (!enable)
+	{
+		m_tuner.reset();
+		m_buffer_tuner.reset();
+	}
+}
+
+Concurrency_tuner* IO_task::_get_tuner()
+{
+	return m_tuner.get();
+}
+
+Buffer_tuner* IO_task::_get_buffer_tuner()
+{
+	return m_buffer_tuner.get();
+}
+
+void IO_task::tune()
+{
+	if (m_items.empty() || m_dst.empty())
+		return;
+
+	Path dst = m_dst_entry.exists() ? m_dst : m_dst.parent_path();
+	apply_tuning(tune_io(classify_device(m_items.front().src),
+						 classify_device(dst)));
+}
+
+void IO_task::apply_tuning(const IO_tuning& tuning)
+{
+	m_buffer_size = tuning.buffer_size;
+	m_range_workers = tuning.range_workers;
+	m_tuner.reset(new Concurrency_tuner {
+			tuning.range_workers,
+			std::min(tuning.max_range_workers, max_range_workers)});
+	m_buffer_tuner.reset(new Buffer_tuner {tuning.buffer_size,
+										   max_tuned_buffer_size});
+}
+
 void IO_task::start_tasking()
 {
 	m_tasking_thread = Interruptible_thread {[&]{
 		try {
 			tasking();
 		} catch (const IO_task_fatal& e) {
+			flush_errors();
 			on_error(static_cast<const Filesystem_error&>(e));
 			set_status(Status::failed);
+		} catch (const Hard_thread_interrupt&) {
+			flush_errors();
+			throw;
 		}
 	}};
 }
@@ -321,14 +1494,46 @@ const IO_task::Item& IO_task::current_item() const
 	return m_items.front();
 }
 
+void IO_task::queue_progress(const Path& src, const Path& dst)
+{
+	unsigned nth = m_progress_nth.load(std::memory_order_relaxed);
+	if (nth == 0 || ++m_progress_count < nth)
+		return;
+
+	m_progress_count = 0;
+
+	bool queued = m_progress.push([&](Progress_event& ev) {
+			ev.src = src;
+			ev.dst = dst;
+		});
+
+	if (!queued)
+		m_progress_dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
 void IO_task::reset_context()
 {
 	m_ctx.offset = 0;
 	m_ctx.dir_iter = Recursive_directory_iterator {};
+	m_ctx.pending.clear();
+	m_ctx.ranges.clear();
 }
 
 void IO_task::tasking()
 {
+	m_dst_entry.refresh();
+
+	// Only when started for the first time,
+	// the tuner keeps what it has learned.
+	if (m_auto_tuning && !m_tuner)
+		tune();
+
+	// The time the task has been paused doesn't count.
+	if (m_buffer_tuner)
+		m_buffer_tuner->restart(std::chrono::steady_clock::now());
+
+	m_symlinks.clear();
+
 	if (m_check_avail_space)
 	{
 		set_status(Status::preparing);
@@ -342,35 +1547,59 @@ void IO_task::tasking()
 		}
 	}
 
+	// Only the pre-scan counts the visited directories.
+	m_visited.clear();
+
 	set_status(Status::pending);
 	m_start = std::chrono::steady_clock::now();
 
 	while (!m_items.empty())
 	{
 		hard_interruption_point();
-		auto head = m_items.begin();
 
 		try { dispatch_item(m_items.front()); }
 		catch (const IO_task_error& e) { may_fail(e); }
 		catch (const Filesystem_error& e) { may_fail(e); }
 
-		m_items.erase(head);
+		flush_errors();
+		m_items.pop_front();
 		reset_context();
 	}
 
+	sync_destination();
+
 	set_status(Status::finished);
 }
 
+void IO_task::sync_destination()
+{
+	if (m_dst.empty() || (m_durability != Durability::batched &&
+						  m_durability != Durability::ordered))
+		return;
+
+	for (Target& t : m_targets)
+	{
+		if (!t.err && (t.err = sync_filesystem(t.root)))
+			on_error(Filesystem_error {t.root, t.err});
+	}
+
+	if (int err = sync_filesystem(m_dst))
+		throw IO_task_fatal {m_dst, err};
+}
+
 void IO_task::set_status(IO_task::Status st)
 {
 	m_status = st;
 	on_status_change(st);
 }
 
-void IO_task::handle_symlink(const Path& src, const Path* abs_deref,
-							 const Path& dst, std::deque<IO_task::Item>& items)
+int IO_task::handle_symlink(const Path& src, const Path* abs_deref,
+							const Path& dst, std::list<IO_task::Item>& items)
 {
-	Path link_target = read_symlink(src);
+	int err;
+	Path link_target = read_symlink(src, err);
+	if (err) return err;
+
 	Path new_target;
 	if (m_update_symlinks && link_target.is_absolute())
 	{
@@ -381,88 +1610,131 @@ void IO_task::handle_symlink(const Path& src, const Path* abs_deref,
 	else
 		new_target = link_target;
 
-	assert(!(m_deref_symlinks && !abs_deref));
-	if (m_deref_symlinks && !is_in_parent_path(*abs_deref, src))
+	if (m_deref_symlinks && abs_deref && !m_ancestors.contains(*abs_deref))
 	{
-		items.emplace_front(*abs_deref, dst);
-		return;
+		// The current item has to stay at the front (see Context).
+		items.emplace(std::next(items.begin()), *abs_deref, dst,
+					  m_ancestors);
+		return 0;
 	}
 
-	process_symlink(new_target, dst, src);
+	return process_symlink(new_target, dst, src);
 }
 
-void IO_task::traverse_directory(Recursive_directory_iterator it, const Path& i,
-		std::function<bool(const Stat&, const Path&)>&& fn)
+void IO_task::may_fail(const Path& src, const Path& dst, int err)
 {
-	while (!it.at_end())
+	if (err == ENOENT)
 	{
-		hard_interruption_point();
+		flush_errors();
+		throw IO_task_fatal {src, err};
+	}
+	else
+		report_error(src, dst, err);
+}
+
+void IO_task::report_error(const Path& src, const Path& dst, int err)
+{
+	if (!m_error_batch.empty()
+		&& !m_error_batch.get_directory().string_equals(src.parent_path()))
+		flush_errors();
+
+	m_error_batch.add(src, dst, err);
+}
 
-		Path p = i / *it;
-		Stat st = hawk::symlink_status(p);
+void IO_task::flush_errors()
+{
+	if (m_error_batch.empty())
+		return;
 
-		if ( !(is_symlink(st) && is_in_parent_path(canonical(p, "/"), p)) )
-		{
-			if (!fn(st, i / *it))
-				break;
-		}
+	on_error(m_error_batch);
+	m_error_batch.clear();
+}
 
-		try {
-			if (is_symlink(st))
-				it.orthogonal_increment();
-			else
-				++it;
-		} catch (const Filesystem_error&) {
-			it.orthogonal_increment();
-		}
-	}
+void IO_task::reset_visited()
+{
+	m_visited.clear();
+	for (const Item& i : m_items)
+		m_visited.insert_ancestors(i.src);
 }
 
-void IO_task::may_fail(const Path& src, const Path& dst, int err) const
+void IO_task::on_error(const IO_task_error_batch& b) const noexcept
 {
-	if (err == ENOENT)
-		throw IO_task_fatal {src, err};
-	else
-		on_error(IO_task_error {src, dst, err});
+	for (const IO_task_error& e : b.get_errors())
+		on_error(e);
 }
 
 void IO_task::dispatch_item(Item& i)
 {
-	s_monitor_callbacks.tmon(this, Task_progress {i.src, i.dst});
+	queue_progress(i.src, i.dst);
 
-	Stat st = hawk::symlink_status(i.src);
+	m_ancestors = i.ancestors;
+	m_ancestors.push_ancestors(i.src);
+	m_ancestors.set_top();
+
+	int err;
+	File_entry src {i.src, false};
+	const Stat& st = src.stat(stat_basic, err);
+
+	if (err)
+	{
+		may_fail(i.src, i.dst, err);
+		return;
+	}
 
 	if (is_symlink(st))
 	{
-		Path abs_deref = canonical(i.src, "/");
-		handle_symlink(i.src, &abs_deref, i.dst, m_items);
+		Path abs_deref;
+		if (m_deref_symlinks)
+			abs_deref = m_symlinks.resolve(i.src, err);
+
+		err = handle_symlink(i.src, (err) ? nullptr : &abs_deref,
+							 i.dst, m_items);
+		if (err)
+			may_fail(i.src, i.dst, err);
 
 		return;
 	}
 
 	if (i.dst.empty())
 	{
-		if (exists(m_dst) && is_directory(m_dst))
+		int dst_err;
+		if (m_dst_entry.is_directory(dst_err))
 			i.dst = m_dst / i.src.filename();
 		else
+		{
 			i.dst = m_dst;
+			// One of the items may create it.
+			m_dst_entry.refresh();
+		}
 	}
 
 	if (is_regular_file(st))
-		process_file(i);
+	{
+		if ((err = process_file(src, i.dst)))
+			may_fail(i.src, i.dst, err);
+	}
 	else if (is_directory(st))
-		process_directory(i);
+		process_directory(i, src);
 }
 
 bool IO_task::has_enough_space()
 {
 	uintmax_t avail;
-	if (exists(m_dst))
+	if (m_dst_entry.exists())
 		avail = space(m_dst).available;
 	else
 		avail = space(m_dst.parent_path()).available;
 
 	uintmax_t total = 0;
+	reset_visited();
+
+	// The files walked past but not copied yet, the front one
+	// may have been copied partially.
+	bool pending = !m_ctx.pending.empty();
+	for (const Pending_file& f : m_ctx.pending)
+		total += f.size;
+	if (pending)
+		total -= std::min(total, m_ctx.offset);
 
 	std::deque<Path> srcs;
 	for (const Item& i : m_items)
@@ -472,17 +1744,21 @@ bool IO_task::has_enough_space()
 	Recursive_directory_iterator dir_iter;
 	if (!m_ctx.dir_iter.at_end())
 	{
-		dir_iter = Recursive_directory_iterator {srcs.front()};
-		dir_iter.advance(m_ctx.dir_iter);
-		dir_resumed_state = true;
+		int err;
+		dir_iter = m_ctx.dir_iter.clone(err);
 
-		if (m_ctx.offset != 0)
+		// Otherwise the whole item is walked again, counting what has
+		// been copied already rather than missing what hasn't.
+		if (!err)
 		{
-			std::advance(dir_iter, 2);
-			// 2: m_ctx.dir_iter hasn't moved to the current file yet.
-			// Also, we want to skip the current file.
+			dir_resumed_state = true;
+
+			// m_ctx.dir_iter points to the file being copied,
+			// we want to skip it.
+			if (m_ctx.file_started() && !pending)
+				dir_iter.orthogonal_increment(err);
 		}
-	} else if (m_ctx.offset != 0)
+	} else if (m_ctx.file_started() || pending)
 		srcs.pop_front();
 
 	while (!srcs.empty())
@@ -494,7 +1770,15 @@ bool IO_task::has_enough_space()
 
 		auto head = srcs.begin();
 		const Path& src = *head;
-		Stat st = hawk::symlink_status(src);
+
+		int err;
+		Stat st = hawk::symlink_status(src, err);
+		if (err)
+		{
+			// The item will fail during its processing.
+			srcs.erase(head);
+			continue;
+		}
 
 		try {
 			total = accumulate_file_size(st, src, dir_iter, dir_resumed_state,
@@ -505,20 +1789,31 @@ bool IO_task::has_enough_space()
 		srcs.erase(head);
 	}
 
+	// An additional destination without enough space is dropped,
+	// it doesn't fail the whole task.
+	for (Target& t : m_targets)
+	{
+		if (t.err) continue;
+
+		int err;
+		Space_info si = space(exists(t.root) ? t.root : t.root.parent_path(),
+							  err);
+		if (err || si.available < total)
+		{
+			t.err = (err) ? err : ENOSPC;
+			on_error(Filesystem_error {t.root, t.err});
+		}
+	}
+
 	m_total = total;
 
 	return true;
 }
 
-void IO_task::process_file(const IO_task::Item& i)
-{
-	process_file(i.src, i.dst);
-}
-
 // IO_task_copy implementation
 
 uintmax_t IO_task_copy::accumulate_file_size(
-		const Stat& st, const Path& p, Recursive_directory_iterator dir_iter,
+		const Stat& st, const Path& p, Recursive_directory_iterator& dir_iter,
 		bool resumed_state, uintmax_t total, uintmax_t avail,
 		std::deque<Path>& srcs)
 {
@@ -529,7 +1824,8 @@ uintmax_t IO_task_copy::accumulate_file_size(
 		if (!resumed_state)
 			dir_iter = Recursive_directory_iterator {p};
 
-		IO_task::traverse_directory(dir_iter, p,
+		m_visited.insert(st);
+		walk_sizes(dir_iter, m_visited,
 			[&](const Stat& st, const Path& i) {
 				if (is_regular_file(st))
 				{
@@ -539,9 +1835,10 @@ uintmax_t IO_task_copy::accumulate_file_size(
 				}
 				else if (m_deref_symlinks && is_symlink(st))
 				{
-					Path deref = canonical(i, "/");
+					int err;
+					Path deref = m_symlinks.resolve(i, err);
 
-					if (!is_in_parent_path(i, deref))
+					if (!err && !m_visited.contains(deref))
 						srcs.push_back(deref);
 				}
 
@@ -550,103 +1847,329 @@ uintmax_t IO_task_copy::accumulate_file_size(
 	}
 	else if (is_symlink(st) && m_deref_symlinks)
 	{
-		Path deref = canonical(p, "/");
-		if (!is_in_parent_path(p, deref))
+		int err;
+		Path deref = m_symlinks.resolve(p, err);
+
+		if (!err && !m_visited.contains(deref))
 			srcs.push_back(deref);
 	}
 
 	return total;
 }
 
-void IO_task_copy::traverse_directory(
-		Recursive_directory_iterator& dir_iter, Item& i)
+class IO_task_copy::Walker
 {
-	while (!dir_iter.at_end())
-	{
-		hard_interruption_point();
+private:
+	IO_task_copy& m_task;
+	const Item& m_item;
 
-		Path p = *dir_iter;
-		Path src = i.src / p;
-		Path dst = i.dst / p;
-		Stat st = symlink_status(src);
+public:
+	Walker(IO_task_copy& task, const Item& item)
+		: m_task(task), m_item(item)
+	{}
 
-		s_monitor_callbacks.tmon(this, Task_progress {src, dst});
+	void before(const Recursive_directory_iterator& it)
+	{
+		m_task.m_ancestors.leave(it.level());
+	}
 
-		try {
-			if (is_symlink(st) && (
-					!m_deref_symlinks || is_in_parent_path(i.src, src)))
-			{
-				dir_iter.orthogonal_increment();
-			}
-			else
-				++dir_iter;
-		} catch (const Filesystem_error& e) {
-			may_fail(src, dst, e.get_errno());
-			dir_iter.orthogonal_increment();
+	Walk_action visit(const Path& rel, const Path& src, const Stat& st,
+					  int err)
+	{
+		Path dst = m_item.dst / rel;
+		m_task.queue_progress(src, dst);
+
+		if (err)
+		{
+			m_task.may_fail(src, dst, err);
+			return Walk_action::skip;
 		}
 
 		if (is_directory(st))
 		{
-			int err = 0;
 			create_directory(dst, err);
 
 			// Ignore existing directory.
 			if (err && err != EEXIST)
-				on_error(IO_task_error {src, dst, err});
+			{
+				// Don't enter a directory we have nowhere to copy to.
+				m_task.report_error(src, dst, err);
+				return Walk_action::skip;
+			}
+
+			m_task.create_target_directories(src, dst);
+			m_task.m_ancestors.push(st);
+			return Walk_action::enter;
 		}
-		else if (is_regular_file(st))
+
+		if (m_task.m_extent_ordering && is_regular_file(st))
 		{
-			try { process_file(src, dst); }
-			catch (const Filesystem_error& e) {
-				may_fail(src, dst, e.get_errno());
-				m_ctx.offset = 0;
+			m_task.m_ctx.pending.push_back({src, dst, file_size(st)});
+			return Walk_action::skip;
+		}
 
-				return;
-			}
+		// Files are processed before incrementing the iterator so that
+		// an interrupted copy resumes at the same file (see Context).
+
+		if (is_regular_file(st))
+		{
+			File_entry entry {src, st, false};
+			err = m_task.process_file(entry, dst);
 
 			// Reset offset after copy_file() has finished.
-			m_ctx.offset = 0;
+			m_task.m_ctx.offset = 0;
 		}
 		else if (is_symlink(st))
 		{
-			Path abs_deref = canonical(src, "/");
-			handle_symlink(src, &abs_deref, dst, m_items);
+			Path abs_deref;
+			if (m_task.m_deref_symlinks)
+				abs_deref = m_task.m_symlinks.resolve(src, err);
+
+			err = m_task.handle_symlink(src, (err) ? nullptr : &abs_deref,
+										dst, m_task.m_items);
+		}
+
+		if (err)
+			m_task.may_fail(src, dst, err);
+
+		return Walk_action::skip;
+	}
+
+	void advanced(const Path& rel, int err)
+	{
+		if (err)
+			m_task.may_fail(m_item.src / rel, m_item.dst / rel, err);
+
+		// The pending files are copied only once the iterator
+		// has moved past them (see Context).
+		if (m_task.m_ctx.pending.size() >= extent_batch_size)
+		{
+			m_task.schedule_pending();
+			m_task.copy_pending();
 		}
 	}
+};
+
+void IO_task_copy::traverse_directory(
+		Recursive_directory_iterator& dir_iter, Item& i)
+{
+	// Finish the file interrupted by pause() first.
+	if (m_ctx.file_started())
+		copy_pending();
+
+	Walker walker {*this, i};
+	walk_tree(dir_iter, walker);
+
+	schedule_pending();
+	copy_pending();
+}
+
+void IO_task_copy::set_extent_ordering(bool enable)
+{
+	m_extent_ordering = enable;
+}
+
+void IO_task_copy::apply_tuning(const IO_tuning& tuning)
+{
+	IO_task::apply_tuning(tuning);
+	m_extent_ordering = tuning.extent_ordering;
+}
+
+void IO_task_copy::schedule_pending()
+{
+	std::deque<Pending_file>& pending = m_ctx.pending;
+
+	// Don't move a partially copied file away from the front.
+	auto first = pending.begin() + ((m_ctx.file_started()) ? 1 : 0);
+	if (pending.end() - first < 2)
+		return;
+
+	std::vector<std::pair<Extent_key, size_t>> keys;
+	keys.reserve(pending.end() - first);
+	for (auto it = first; it != pending.end(); ++it)
+		keys.emplace_back(extent_key(it->src), keys.size());
+
+	std::sort(keys.begin(), keys.end());
+
+	std::deque<Pending_file> sorted;
+	if (first != pending.begin())
+		sorted.push_back(std::move(pending.front()));
+	for (const auto& k : keys)
+		sorted.push_back(std::move(first[k.second]));
+
+	pending = std::move(sorted);
+}
+
+void IO_task_copy::copy_pending()
+{
+	while (!m_ctx.pending.empty())
+	{
+		hard_interruption_point();
+
+		const Pending_file& f = m_ctx.pending.front();
+		File_entry src {f.src, false};
+		int err = process_file(src, f.dst);
+
+		// Reset offset after copy_file() has finished.
+		m_ctx.offset = 0;
+
+		if (err)
+			may_fail(f.src, f.dst, err);
+
+		m_ctx.pending.pop_front();
+	}
 }
 
-void IO_task_copy::process_directory(Item& i)
+void IO_task_copy::process_directory(Item& i, File_entry& src)
 {
 	Recursive_directory_iterator& dir_iter = m_ctx.dir_iter;
 
-	if (dir_iter.at_end())
+	// The whole directory may have been walked already
+	// with only the pending files left to copy.
+	if (dir_iter.at_end() && m_ctx.pending.empty())
 	{
 		dir_iter = Recursive_directory_iterator {i.src};
 		create_directory(i.dst);
+		create_target_directories(i.src, i.dst);
+	}
+	else if (!dir_iter.at_end())
+	{
+		// The directories above the entry the task has been paused at
+		// have been entered before.
+		push_entered(m_ancestors, dir_iter);
 	}
 
 	traverse_directory(dir_iter, i);
-	copy_permissions(i.src, i.dst);
+
+	int err;
+	copy_permissions(src, i.dst, err);
+	if (err)
+		report_error(i.src, i.dst, err);
+
+	for (Target& t : m_targets)
+	{
+		if (t.err) continue;
+
+		Path dst = target_path(i.dst, t);
+		copy_permissions(src, dst, err);
+		if (err)
+			target_error(t, i.src, dst, err);
+	}
 }
 
-void IO_task_copy::process_file(const Path& src, const Path& dst)
+int IO_task_copy::process_file(File_entry& src, const Path& dst)
 {
-	copy_file(this, m_ctx, src, dst);
-	copy_permissions(src, dst);
+	if (!m_ctx.file_started())
+	{
+		m_outputs.assign(1, Copy_output {dst, 0});
+		for (const Target& t : m_targets)
+			m_outputs.push_back({target_path(dst, t), t.err});
+	}
+
+	if (!m_fanout)
+		m_fanout.reset(new Fanout);
+
+	int err = copy_file(this, m_ctx, src.path(), m_outputs, *m_fanout);
+	if (err) return err;
+
+	for (Copy_output& o : m_outputs)
+	{
+		if (!o.err)
+			copy_permissions(src, o.dst, o.err);
+	}
+
+	for (size_t n = 0; n < m_targets.size(); ++n)
+	{
+		Copy_output& o = m_outputs[n + 1];
+		if (o.err && !m_targets[n].err)
+			target_error(m_targets[n], src.path(), o.dst, o.err);
+	}
+
+	return m_outputs.front().err;
 }
 
-void IO_task_copy::process_symlink(const Path& target, const Path& linkpath,
-								   const Path&)
+int IO_task_copy::process_symlink(const Path& target, const Path& linkpath,
+								  const Path& src)
 {
 	int err;
+	for (Target& t : m_targets)
+	{
+		if (t.err) continue;
+
+		// Keep the symlinks updated by handle_symlink() pointing
+		// into the same destination.
+		Path dst = target_path(linkpath, t);
+		create_symlink(is_in_parent_path(m_dst, target) ?
+					   target_path(target, t) : target, dst, err);
+		if (err && err != ENOENT)
+			target_error(t, src, dst, err);
+	}
+
 	create_symlink(target, linkpath, err);
 
-	if (err)
+	// ENOENT is not a reason to fail the whole task here.
+	return (err == ENOENT) ? 0 : err;
+}
+
+void IO_task_copy::add_destination(const Path& dst)
+{
+	m_targets.push_back({dst, 0});
+}
+
+void IO_task_copy::Fanout_release::operator()(Fanout* fanout) const noexcept
+{
+	delete fanout;
+}
+
+Path IO_task_copy::target_path(const Path& dst, const Target& t) const
+{
+	// dst is m_dst or a path inside it, they're compared by components
+	// as they may differ in redundant separators.
+	const char* base = m_dst.c_str();
+	const char* rest = dst.c_str();
+	for (;;)
 	{
-		if (err != ENOENT)
-			throw Filesystem_error {linkpath, err};
-		else
-			return;
+		while (*base == '/') ++base;
+		while (*rest == '/') ++rest;
+		if (!*base) break;
+
+		size_t n = strcspn(base, "/");
+		if (strncmp(base, rest, n) != 0 || (rest[n] != '/' && rest[n]))
+			return t.root / dst.filename();
+
+		base += n;
+		rest += n;
+	}
+
+	return (*rest) ? t.root / rest : t.root;
+}
+
+void IO_task_copy::target_error(Target& t, const Path& src, const Path& dst,
+								int err)
+{
+	report_error(src, dst, err);
+
+	// Errors no other entry would escape.
+	if (err == ENOSPC || err == EDQUOT || err == EROFS || err == EIO)
+	{
+		t.err = err;
+		flush_errors();
+		on_error(Filesystem_error {t.root, err});
+	}
+}
+
+void IO_task_copy::create_target_directories(const Path& src, const Path& dst)
+{
+	for (Target& t : m_targets)
+	{
+		if (t.err) continue;
+
+		int err;
+		Path target_dst = target_path(dst, t);
+		create_directory(target_dst, err);
+
+		if (err && err != EEXIST)
+			target_error(t, src, target_dst, err);
 	}
 }
 
@@ -654,121 +2177,152 @@ void IO_task_copy::process_symlink(const Path& target, const Path& linkpath,
 
 IO_task_move::IO_task_move(const Path& src, const Path& dst,
 						   bool update_symlinks)
-	: IO_task{src, dst, false, update_symlinks}, m_prev_level{-1}
+	: IO_task{src, dst, false, update_symlinks}
 {
-	m_dst_st = (exists(m_dst)) ? hawk::status(m_dst)
-							   : hawk::status(m_dst.parent_path());
+	int err;
+	m_dst_st = hawk::status(m_dst, stat_type, err);
+	if (err)
+		m_dst_st = hawk::status(m_dst.parent_path(), stat_type);
 }
 
 IO_task_move::IO_task_move(const std::vector<Path>& srcs, const Path& dst,
 						   bool update_symlinks)
-	: IO_task{srcs, dst, false, update_symlinks}, m_prev_level{-1}
+	: IO_task{srcs, dst, false, update_symlinks}
 {
-	m_dst_st = (exists(m_dst)) ? hawk::status(m_dst)
-							   : hawk::status(m_dst.parent_path());
+	int err;
+	m_dst_st = hawk::status(m_dst, stat_type, err);
+	if (err)
+		m_dst_st = hawk::status(m_dst.parent_path(), stat_type);
 }
 
-void IO_task_move::traverse_directory(
-		Recursive_directory_iterator& dir_iter, IO_task::Item& i)
+class IO_task_move::Walker
 {
-	while (!dir_iter.at_end())
-	{
-		if (m_prev_level > dir_iter.level())
-		{
-			remove_ndirectories(m_prev_level - dir_iter.level() - 1,
-								std::move(m_prev_path));
-			m_prev_level = -1;
-		}
-
-		hard_interruption_point();
+private:
+	IO_task_move& m_task;
+	const Item& m_item;
 
-		Path p = *dir_iter;
-		Path src = i.src / p;
-		Path dst = i.dst / p;
-		Stat st = symlink_status(src);
-		m_prev_level = dir_iter.level();
+public:
+	Walker(IO_task_move& task, const Item& item)
+		: m_task(task), m_item(item)
+	{}
 
-		s_monitor_callbacks.tmon(this, Task_progress {src, dst});
+	// The source directories left by the iterator are empty now.
+	void before(const Recursive_directory_iterator& it)
+	{
+		Path failed;
+		if (int err = remove_left_directories(m_task.m_dirs, it.level(),
+											  failed))
+			m_task.report_error(failed, Path(), err);
+	}
 
-		// Increment the iterator.
+	Walk_action visit(const Path& rel, const Path& src, const Stat& st,
+					  int err)
+	{
+		Path dst = m_item.dst / rel;
+		m_task.queue_progress(src, dst);
 
-		try {
-			if (is_directory(st))
-				++dir_iter;
-			else
-				dir_iter.orthogonal_increment();
-		} catch (const Filesystem_error& e) {
-			may_fail(src, dst, e.get_errno());
-			dir_iter.orthogonal_increment();
+		if (err)
+		{
+			m_task.may_fail(src, dst, err);
+			return Walk_action::skip;
 		}
 
-		// Handle the direrectory/file/symlink.
-
 		if (is_directory(st))
 		{
-			int err;
 			create_directory(dst, err);
 
 			if (err && err != EEXIST)
 			{
-				on_error(IO_task_error {src, dst, err});
-				continue;
+				// Don't enter a directory we have nowhere to move to.
+				m_task.report_error(src, dst, err);
+				return Walk_action::skip;
 			}
 
-			m_prev_path = src;
+			m_task.m_dirs.push_back(src);
+			return Walk_action::enter;
 		}
-		else
-		{
-			if (is_regular_file(st))
-			{
-				try { process_file(src, dst); }
-				catch (const Filesystem_error& e) {
-					may_fail(src, dst, e.get_errno());
-					m_ctx.offset = 0;
 
-					continue;
-				}
+		// Files are processed before incrementing the iterator so that
+		// an interrupted move resumes at the same file (see Context).
 
-				m_ctx.offset = 0;
-			}
-			else if (is_symlink(st))
-				handle_symlink(src, nullptr, dst, m_items);
+		if (is_regular_file(st))
+		{
+			File_entry entry {src, st, false};
+			err = m_task.process_file(entry, dst);
+			m_task.m_ctx.offset = 0;
 		}
+		else if (is_symlink(st))
+			err = m_task.handle_symlink(src, nullptr, dst, m_task.m_items);
+
+		if (err)
+			m_task.may_fail(src, dst, err);
+
+		return Walk_action::skip;
 	}
 
-	copy_permissions(i.src, i.dst);
-	remove_ndirectories(m_prev_level, std::move(m_prev_path));
+	void advanced(const Path& rel, int err)
+	{
+		if (err)
+			m_task.may_fail(m_item.src / rel, m_item.dst / rel, err);
+	}
+};
+
+void IO_task_move::traverse_directory(
+		Recursive_directory_iterator& dir_iter, IO_task::Item& i)
+{
+	Walker walker {*this, i};
+	walk_tree(dir_iter, walker);
+
+	int err;
+	copy_permissions(i.src, i.dst, err);
+	if (err)
+		report_error(i.src, i.dst, err);
+
+	Path failed;
+	if ((err = remove_left_directories(m_dirs, 0, failed)))
+		report_error(failed, Path(), err);
+
+	remove_directory(i.src, err);
+	if (err)
+		report_error(i.src, Path(), err);
 }
 
 void IO_task_move::update_symlinks(const Path& src, const Path& dst)
 {
-	Recursive_directory_iterator it {dst};
+	int err;
+	Recursive_directory_iterator it {dst, err};
+
 	while (!it.at_end())
 	{
 		Path p = *it;
 		Path abs_dst = dst / p;
+		Stat st = symlink_status(abs_dst, err);
 
-		if (is_symlink(symlink_status(abs_dst)))
+		if (!err && is_symlink(st))
 		{
-			it.orthogonal_increment();
+			it.orthogonal_increment(err);
 
-			Path target = read_symlink(abs_dst);
-			if (!target.is_absolute())
+			Path target = read_symlink(abs_dst, err);
+			if (err || !target.is_absolute())
 				continue;
 
 			Path new_target = transform_symlink_path(
 						target, src / p, abs_dst, dst, src.length());
 
-			remove_file(abs_dst);
-			create_symlink(new_target, abs_dst);
+			remove_file(abs_dst, err);
+			if (!err)
+				create_symlink(new_target, abs_dst, err);
+
+			if (err)
+				report_error(src / p, abs_dst, err);
 		}
 		else
-			++it;
+			it.increment(err);
 	}
 }
 
 uintmax_t IO_task_move::accumulate_file_size(
-		const Stat& st, const Path& p, Recursive_directory_iterator dir_iter,
+		const Stat& st, const Path& p, Recursive_directory_iterator& dir_iter,
 		bool resumed_state, uintmax_t total, uintmax_t avail,
 		std::deque<Path>&)
 {
@@ -783,7 +2337,8 @@ uintmax_t IO_task_move::accumulate_file_size(
 		if (!resumed_state)
 			dir_iter = Recursive_directory_iterator {p};
 
-		IO_task::traverse_directory(dir_iter, p,
+		m_visited.insert(st);
+		walk_sizes(dir_iter, m_visited,
 			[&](const Stat& st, const Path&) {
 				if (is_regular_file(st))
 				{
@@ -799,11 +2354,12 @@ uintmax_t IO_task_move::accumulate_file_size(
 	return total;
 }
 
-void IO_task_move::process_directory(Item& i)
+void IO_task_move::process_directory(Item& i, File_entry& src)
 {
-	if (same_dev(hawk::status(i.src), m_dst_st))
+	if (same_dev(src.stat(stat_type), m_dst_st))
 	{
-		rename_move(i.src, i.dst);
+		if (int err = rename_move(i.src, i.dst))
+			throw IO_task_error {i.src, i.dst, err};
 
 		if (m_update_symlinks)
 			update_symlinks(i.src, i.dst);
@@ -822,43 +2378,41 @@ void IO_task_move::process_directory(Item& i)
 	traverse_directory(dir_iter, i);
 }
 
-void IO_task_move::process_file(const Path& src, const Path& dst)
+int IO_task_move::process_file(File_entry& src, const Path& dst)
 {
-	if (same_dev(hawk::status(src), m_dst_st))
-		rename_move(src, dst);
-	else
-	{
-		copy_file(this, m_ctx, src, dst);
-		copy_permissions(src, dst);
+	int err;
+	const Stat& st = src.stat(stat_type, err);
+	if (err) return err;
 
-		if (unlink(src.c_str()) != 0)
-			throw IO_task_error {src, dst, errno};
-	}
+	if (same_dev(st, m_dst_st))
+		return rename_move(src.path(), dst);
+
+	if ((err = copy_file(this, m_ctx, src.path(), dst)))
+		return err;
+
+	// In the ordered mode copy_file() has synced dst's directory.
+	copy_permissions(src, dst, err);
+	if (err) return err;
+
+	return (unlink(src.path().c_str()) != 0) ? errno : 0;
 }
 
-void IO_task_move::process_symlink(const Path& target, const Path& linkpath,
-								   const Path& src)
+int IO_task_move::process_symlink(const Path& target, const Path& linkpath,
+								  const Path& src)
 {
 	int err;
 	create_symlink(target, linkpath, err);
 
 	if (err)
-	{
-		if (err != ENOENT)
-			throw Filesystem_error {linkpath, err};
-		else
-			return;
-	}
+		return (err == ENOENT) ? 0 : err;
 
-	if (unlink(src.c_str()) != 0)
-		throw IO_task_error {target, linkpath, errno};
+	return (unlink(src.c_str()) != 0) ? errno : 0;
 }
 
 void IO_task_move::reset_context()
 {
 	IO_task::reset_context();
-	m_prev_level = -1;
-	m_prev_path.clear();
+	m_dirs.clear();
 }
 
 // IO_task_remove implementation
@@ -872,64 +2426,116 @@ IO_task_remove::IO_task_remove(const std::vector<Path>& pvec)
 {}
 
 uintmax_t IO_task_remove::accumulate_file_size(
-		const Stat&, const Path&, Recursive_directory_iterator,
+		const Stat&, const Path&, Recursive_directory_iterator&,
 		bool, uintmax_t, uintmax_t, std::deque<Path>&)
 {
 	return 0;
 }
 
-void IO_task_remove::process_file(const Path& src, const Path&)
+int IO_task_remove::process_file(File_entry& src, const Path&)
 {
-	remove_file(src);
+	int err;
+	remove_file(src.path(), err);
+
+	return err;
 }
 
 void IO_task_remove::traverse_directory(
 		Recursive_directory_iterator&, IO_task::Item&)
 {}
 
-// The same implementation as in remove_recursively() but interruptible.
-void IO_task_remove::process_directory(IO_task::Item& i)
+class IO_task_remove::Walker
 {
-	Path prev_path;
-	int prev_level = 0;
+private:
+	IO_task_remove& m_task;
+	// Directories we've entered, the innermost one being the last.
+	std::vector<Path> m_dirs;
+	// The entry visited last, removed once the iterator has moved
+	// past it unless it's a directory.
+	Path m_entry;
+	bool m_remove;
 
-	Recursive_directory_iterator it {i.src};
-	while (!it.at_end())
+public:
+	explicit Walker(IO_task_remove& task) : m_task(task), m_remove{false} {}
+
+	// We've left these directories which means
+	// they're now empty and should be safe to remove.
+	void before(const Recursive_directory_iterator& it)
 	{
-		if (prev_level > it.level())
+		Path failed;
+		if (int err = remove_left_directories(m_dirs, it.level(), failed))
+			m_task.report_error(failed, Path(), err);
+	}
+
+	Walk_action visit(const Path&, const Path& p, const Stat& st, int err)
+	{
+		m_task.queue_progress(p, Path());
+
+		m_entry = p;
+		m_remove = false;
+
+		if (err)
 		{
-			// We've left a directory/directories which means
-			// they're now empty and should be safe to remove.
-			remove_ndirectories(
-						prev_level - it.level() - 1, std::move(prev_path));
+			m_task.may_fail(p, Path(), err);
+			return Walk_action::skip;
 		}
 
-		try { hard_interruption_point(); }
-		catch (...) { reset_context(); throw; }
+		if (is_directory(st))
+		{
+			m_dirs.push_back(p);
+			return Walk_action::enter;
+		}
 
-		Path p = i.src / *it;
-		Stat st = symlink_status(p);
-		prev_level = it.level();
+		// Don't iterate through symlinks.
+		m_remove = true;
+		return Walk_action::skip;
+	}
 
-		s_monitor_callbacks.tmon(this, Task_progress {p, Path()});
+	void advanced(const Path&, int err)
+	{
+		if (err)
+			m_task.may_fail(m_entry, Path(), err);
 
-		if (is_symlink(st))
-			it.orthogonal_increment(); // Don't iterate through symlinks.
-		else
-			++it;
+		if (m_remove)
+		{
+			remove_file(m_entry, err);
+			if (err)
+				m_task.may_fail(m_entry, Path(), err);
+		}
+	}
 
-		if (!is_directory(st))
-			remove_file(p);
-		else
-			prev_path = p;
+	// Removes the directories left.
+	void finish()
+	{
+		Path failed;
+		if (int err = remove_left_directories(m_dirs, 0, failed))
+			m_task.report_error(failed, Path(), err);
 	}
+};
+
+// The same implementation as in remove_recursively() but interruptible.
+void IO_task_remove::process_directory(IO_task::Item& i, File_entry&)
+{
+	Recursive_directory_iterator it {i.src};
+	Walker walker {*this};
+
+	try { walk_tree(it, walker); }
+	catch (...) { reset_context(); throw; }
+
+	walker.finish();
 
-	remove_ndirectories(prev_level, std::move(prev_path));
+	int err;
+	remove_directory(i.src, err);
+	if (err)
+		report_error(i.src, Path(), err);
 }
 
-void IO_task_remove::process_symlink(const Path&, const Path&, const Path& src)
+int IO_task_remove::process_symlink(const Path&, const Path&, const Path& src)
 {
-	remove_file(src);
+	int err;
+	remove_file(src, err);
+
+	return err;
 }
 
 } // namespace hawk
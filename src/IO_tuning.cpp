@@ -0,0 +1,299 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <cstdlib>
+#include <algorithm>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <linux/magic.h>
+#include "IO_tuning.h"
+
+namespace hawk {
+
+namespace {
+
+// How long a number of workers is measured before it's compared
+// with the others.
+constexpr std::chrono::milliseconds probe_period {2000};
+
+// Returns 0 if the file can't be read.
+unsigned read_sysfs_uint(const std::string& path) noexcept
+{
+	FILE* f = fopen(path.c_str(), "r");
+	if (!f) return 0;
+
+	unsigned val;
+	if (fscanf(f, "%u", &val) != 1)
+		val = 0;
+
+	fclose(f);
+
+	return val;
+}
+
+// The buffer size is tuned in multiples of this.
+constexpr size_t buffer_unit = 64 * 1024;
+
+struct Device_params
+{
+	unsigned range_workers;
+	unsigned max_workers;
+	size_t buffer_size;
+};
+
+Device_params device_params(const Device_info& info) noexcept
+{
+	constexpr size_t KiB = 1024;
+
+	switch (info.type)
+	{
+	case Device_class::rotational:
+		// Parallel streams only make the heads seek.
+		return {1, 1, 1024 * KiB};
+	case Device_class::ssd:
+		return {2, 8, 512 * KiB};
+	case Device_class::nvme:
+		return {4, 16, 1024 * KiB};
+	case Device_class::network:
+		// Covers the latency of the round trips.
+		return {4, 16, 1024 * KiB};
+	case Device_class::memory:
+		return {2, 4, 256 * KiB};
+	default:
+		return {1, 4, 64 * KiB};
+	}
+}
+
+}
+
+Device_info classify_device(const Path& p) noexcept
+{
+	Device_info info {Device_class::unknown, 0, 0};
+
+	struct statfs sfs;
+	if (statfs(p.c_str(), &sfs) == 0)
+	{
+		info.fs_type = sfs.f_type;
+
+		switch (sfs.f_type)
+		{
+		case NFS_SUPER_MAGIC:
+		case SMB_SUPER_MAGIC:
+		case CIFS_SUPER_MAGIC:
+		case SMB2_SUPER_MAGIC:
+		case CEPH_SUPER_MAGIC:
+		case AFS_SUPER_MAGIC:
+		case AFS_FS_MAGIC:
+		case V9FS_MAGIC:
+		case FUSE_SUPER_MAGIC:
+			info.type = Device_class::network;
+			return info;
+		case TMPFS_MAGIC:
+		case RAMFS_MAGIC:
+			info.type = Device_class::memory;
+			return info;
+		}
+	}
+
+	struct stat st;
+	if (stat(p.c_str(), &st) != 0)
+		return info;
+
+	// Filesystems with anonymous devices (e.g. btrfs, overlayfs)
+	// aren't found here.
+	char dev_path[64];
+	snprintf(dev_path, sizeof(dev_path), "/sys/dev/block/%u:%u",
+			 major(st.st_dev), minor(st.st_dev));
+
+	char real_path[PATH_MAX];
+	if (!realpath(dev_path, real_path))
+		return info;
+
+	std::string dev = real_path;
+
+	// A partition has no queue of its own.
+	if (access((dev + "/partition").c_str(), F_OK) == 0)
+		dev.erase(dev.rfind('/'));
+
+	std::string name = dev.substr(dev.rfind('/') + 1);
+	std::string queue = dev + "/queue";
+
+	info.nr_requests = read_sysfs_uint(queue + "/nr_requests");
+
+	if (name.compare(0, 4, "nvme") == 0)
+		info.type = Device_class::nvme;
+	else if (name.compare(0, 4, "zram") == 0 || name.compare(0, 3, "ram") == 0)
+		info.type = Device_class::memory;
+	else if (access((queue + "/rotational").c_str(), F_OK) == 0)
+	{
+		info.type = (read_sysfs_uint(queue + "/rotational")) ?
+			Device_class::rotational : Device_class::ssd;
+	}
+
+	return info;
+}
+
+IO_tuning tune_io(const Device_info& src, const Device_info& dst) noexcept
+{
+	Device_params s = device_params(src);
+	Device_params d = device_params(dst);
+
+	IO_tuning tuning;
+
+	// The slower device decides how many streams make sense.
+	tuning.range_workers = std::min(s.range_workers, d.range_workers);
+	tuning.max_range_workers = std::min(s.max_workers, d.max_workers);
+
+	// A shallow queue (e.g. SATA's NCQ) doesn't take much parallelism.
+	for (const Device_info* info : {&src, &dst})
+	{
+		if (info->nr_requests != 0 && info->nr_requests < 64)
+		{
+			tuning.range_workers = std::min(tuning.range_workers, 2u);
+			tuning.max_range_workers =
+				std::min(tuning.max_range_workers, 4u);
+		}
+	}
+
+	tuning.buffer_size = std::max(s.buffer_size, d.buffer_size);
+	tuning.extent_ordering = (src.type == Device_class::rotational);
+
+	return tuning;
+}
+
+// Concurrency_tuner implementation
+
+Concurrency_tuner::Concurrency_tuner(unsigned workers, unsigned max_workers)
+	:
+	  m_max{std::max(max_workers, 1u)},
+	  m_initial{std::min(std::max(workers, 1u), m_max)},
+	  m_workers{m_initial},
+	  m_best{m_initial},
+	  m_best_rate{0},
+	  m_phase{Phase::measure},
+	  m_period_start{Clock::now()},
+	  m_period_bytes{0}
+{}
+
+void Concurrency_tuner::probe(Phase phase, unsigned workers, uintmax_t bytes,
+							  Clock::time_point now)
+{
+	m_phase = phase;
+	m_workers = workers;
+	restart(bytes, now);
+}
+
+void Concurrency_tuner::settle(unsigned workers)
+{
+	m_phase = Phase::settled;
+	m_workers = workers;
+}
+
+void Concurrency_tuner::restart(uintmax_t bytes, Clock::time_point now)
+{
+	m_period_start = now;
+	m_period_bytes = bytes;
+}
+
+unsigned Concurrency_tuner::update(uintmax_t bytes, Clock::time_point now)
+{
+	auto elapsed = now - m_period_start;
+	if (m_phase == Phase::settled || elapsed < probe_period)
+		return m_workers;
+
+	double rate = (bytes - m_period_bytes) /
+		std::chrono::duration<double>(elapsed).count();
+
+	switch (m_phase)
+	{
+	case Phase::measure:
+		m_best_rate = rate;
+
+		if (m_workers < m_max)
+			probe(Phase::grow, std::min(m_workers * 2, m_max), bytes, now);
+		else if (m_workers > 1)
+			probe(Phase::shrink, m_workers / 2, bytes, now);
+		else
+			settle(m_workers);
+		break;
+
+	case Phase::grow:
+		// Demand a clear gain, more workers cost more memory
+		// and hurt other IO.
+		if (rate > m_best_rate * 1.15)
+		{
+			m_best = m_workers;
+			m_best_rate = rate;
+
+			if (m_workers < m_max)
+				probe(Phase::grow, std::min(m_workers * 2, m_max), bytes, now);
+			else
+				settle(m_best);
+		}
+		else if (m_best == m_initial && m_best > 1)
+		{
+			// More didn't help, maybe fewer will do.
+			probe(Phase::shrink, m_best / 2, bytes, now);
+		}
+		else
+			settle(m_best);
+		break;
+
+	case Phase::shrink:
+		// Fewer workers doing about the same are better.
+		if (rate >= m_best_rate * 0.95)
+		{
+			m_best = m_workers;
+			m_best_rate = std::max(m_best_rate, rate);
+
+			if (m_workers > 1)
+				probe(Phase::shrink, m_workers / 2, bytes, now);
+			else
+				settle(m_best);
+		}
+		else
+			settle(m_best);
+		break;
+
+	default:
+		break;
+	}
+
+	return m_workers;
+}
+
+// Buffer_tuner implementation
+
+Buffer_tuner::Buffer_tuner(size_t size, size_t max_size)
+	:
+	  m_unit{buffer_unit},
+	  m_bytes{0},
+	  m_tuner{static_cast<unsigned>(std::max<size_t>(size / buffer_unit, 1)),
+			  static_cast<unsigned>(std::max<size_t>(max_size / buffer_unit,
+													 1))}
+{}
+
+}
@@ -19,6 +19,7 @@
 
 #include <functional>
 #include <cstdlib>
+#include <cstring>
 #include <cassert>
 #include <clocale>
 #include <cwchar>
@@ -26,6 +27,86 @@
 
 namespace hawk {
 
+namespace {
+
+// A path is hashed by its components: state = state * hash_mul + name,
+// starting at a seed telling absolute paths from the relative ones.
+// hash_mul is odd and thus invertible, so that a parent's state is
+// derived from its child's by taking the name off again.
+constexpr uint64_t hash_mul = 0x9e3779b97f4a7c15;
+constexpr uint64_t absolute_seed = 0x243f6a8885a308d3;
+constexpr uint64_t relative_seed = 0x13198a2e03707344;
+
+constexpr uint64_t inverse(uint64_t a)
+{
+	// Newton's iteration, every step doubles the number of correct
+	// low bits (a is its own inverse modulo 8).
+	uint64_t x = a;
+	for (int i = 0; i < 5; ++i)
+		x *= 2 - a * x;
+
+	return x;
+}
+
+constexpr uint64_t hash_mul_inv = inverse(hash_mul);
+static_assert(hash_mul * hash_mul_inv == 1, "hash_mul isn't invertible");
+
+// Doesn't need a 128-bit product, so that 32-bit targets hash the same.
+inline uint64_t mix(uint64_t a, uint64_t b) noexcept
+{
+	uint64_t h = (a ^ (b >> 29)) * hash_mul + b;
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93;
+
+	return h ^ (h >> 32);
+}
+
+// Hashes a word at a time, names are short.
+uint64_t hash_name(const char* s, size_t n) noexcept
+{
+	constexpr uint64_t k0 = 0xa4093822299f31d0;
+	constexpr uint64_t k1 = 0x082efa98ec4e6c89;
+
+	uint64_t h = mix(n ^ k0, k1);
+	for (; n >= 8; s += 8, n -= 8)
+	{
+		uint64_t w;
+		memcpy(&w, s, 8);
+		h = mix(w ^ k0, h ^ k1);
+	}
+
+	if (n)
+	{
+		uint64_t w = 0;
+		memcpy(&w, s, n);
+		h = mix(w ^ k1, h ^ k0);
+	}
+
+	return h;
+}
+
+// Adds the non-empty components of [p, end) to state.
+uint64_t hash_components(uint64_t state, const char* p,
+						 const char* end) noexcept
+{
+	while (p < end)
+	{
+		const char* sep = static_cast<const char*>(
+					memchr(p, '/', end - p));
+		if (!sep)
+			sep = end;
+
+		if (sep != p)
+			state = state * hash_mul + hash_name(p, sep - p);
+
+		p = sep + 1;
+	}
+
+	return state;
+}
+
+} // unnamed-namespace
+
 void Path::clear()
 {
 	m_path.clear();
@@ -42,14 +123,42 @@ std::string::size_type Path::length() const
 	return m_path.length();
 }
 
+void Path::truncate(std::string::size_type len)
+{
+	if (len >= m_path.length())
+		return;
+
+	// Take the removed components off m_hash unless len splits one.
+	bool whole = len != 0
+		&& (m_path[len] == '/' || m_path[len - 1] == '/');
+	while (m_hash != 0 && whole)
+	{
+		std::string::size_type pos = m_path.rfind('/');
+		if (pos == std::string::npos || pos < len)
+			pos = len - 1;
+
+		m_hash = parent_hash(pos);
+		if (pos <= len)
+			break;
+
+		m_path.resize(pos);
+	}
+
+	m_path.resize(len);
+	if (!whole)
+		m_hash = 0;
+}
+
 bool operator==(const Path& rhs, const Path& lhs)
 {
-	return const_cast<Path&>(rhs).hash() == const_cast<Path&>(lhs).hash();
+	return rhs.m_path.length() == lhs.m_path.length()
+		&& rhs.hash() == lhs.hash()
+		&& rhs.m_path == lhs.m_path;
 }
 
 bool operator!=(const Path& rhs, const Path& lhs)
 {
-	return const_cast<Path&>(rhs).hash() != const_cast<Path&>(lhs).hash();
+	return !(rhs == lhs);
 }
 
 bool Path::string_equals(const Path& p) const
@@ -59,10 +168,10 @@ bool Path::string_equals(const Path& p) const
 
 Path& Path::operator/=(const Path& p)
 {
-	m_hash = 0;
 	if (p.empty())
 		return *this;
 
+	std::string::size_type pos = m_path.length();
 	if (this != &p)
 	{
 		if (p.m_path.front() != '/')
@@ -79,18 +188,19 @@ Path& Path::operator/=(const Path& p)
 		m_path += rhs.m_path;
 	}
 
-	m_hash = 0;
+	hash_appended(pos);
 
 	return *this;
 }
 
 Path& Path::operator/=(const char* p)
 {
+	std::string::size_type pos = m_path.length();
 	if (*p != '/')
 		append_separator_if_needed();
 
 	m_path += p;
-	m_hash = 0;
+	hash_appended(pos);
 
 	return *this;
 }
@@ -152,7 +262,10 @@ Path Path::parent_path() const
 	if (pos == std::string::npos) return Path {};
 	if (pos == 0) return (m_path[1] == '\0') ? Path {} : Path {"/"};
 
-	return Path {m_path.c_str(), pos};
+	Path parent {m_path.c_str(), pos};
+	parent.m_hash = parent_hash(pos);
+
+	return parent;
 }
 
 void Path::set_parent_path()
@@ -171,7 +284,12 @@ void Path::set_parent_path()
 				m_path = "/";
 		}
 		else
-			m_path = m_path.substr(0, pos);
+		{
+			m_hash = parent_hash(pos);
+			m_path.resize(pos);
+
+			return;
+		}
 	}
 
 	m_hash = 0;
@@ -207,9 +325,22 @@ bool Path::is_absolute() const
 size_t Path::hash() const
 {
 	if (m_hash == 0)
-		m_hash = std::hash<std::string>()(m_path);
+	{
+		const char* p = m_path.data();
+		m_hash = hash_components((is_absolute()) ? absolute_seed
+												 : relative_seed,
+								 p, p + m_path.length());
+	}
+
+	// Finalise, the state itself is linear in the names.
+	uint64_t h = m_hash;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
 
-	return m_hash;
+	return h;
 }
 
 void Path::append_separator_if_needed()
@@ -218,6 +349,31 @@ void Path::append_separator_if_needed()
 		m_path += '/';
 }
 
+void Path::hash_appended(std::string::size_type pos)
+{
+	// Joining to an empty path may make it absolute.
+	if (m_hash == 0 || pos == 0)
+	{
+		m_hash = 0;
+		return;
+	}
+
+	const char* p = m_path.data();
+	m_hash = hash_components(m_hash, p + pos, p + m_path.length());
+}
+
+uint64_t Path::parent_hash(std::string::size_type pos) const
+{
+	if (m_hash == 0)
+		return 0;
+
+	size_t n = m_path.length() - pos - 1;
+	if (n == 0)
+		return m_hash;
+
+	return (m_hash - hash_name(m_path.data() + pos + 1, n)) * hash_mul_inv;
+}
+
 bool is_absolute(const char* path)
 {
 	return *path == '/';
@@ -0,0 +1,403 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cctype>
+#include "Search.h"
+#include "Parallel_walker.h"
+#include "Result_batch.h"
+
+namespace hawk {
+
+namespace {
+
+bool is_special(char c)
+{
+	return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+// Matches c against the class starting at p ('['). next is set past the
+// class or to nullptr if the class isn't terminated, it's a literal
+// '[' then.
+bool match_class(const char* p, const char* pend, char c, const char*& next)
+{
+	const char* q = p + 1;
+	bool negate = (q < pend && (*q == '!' || *q == '^'));
+	if (negate) q++;
+
+	bool matched = false;
+	bool first = true;
+
+	for (; q < pend && (*q != ']' || first); first = false)
+	{
+		char lo = *q++;
+		if (lo == '\\' && q < pend)
+			lo = *q++;
+
+		char hi = lo;
+		if (q + 1 < pend && *q == '-' && q[1] != ']')
+		{
+			q++;
+			hi = *q++;
+			if (hi == '\\' && q < pend)
+				hi = *q++;
+		}
+
+		if (lo <= c && c <= hi)
+			matched = true;
+	}
+
+	if (q >= pend)
+	{
+		next = nullptr;
+		return false;
+	}
+
+	next = q + 1;
+	return matched != negate;
+}
+
+bool glob_match(const char* p, const char* pend,
+				const char* s, const char* send)
+{
+	// Where to resume after a mismatch, i.e. the last '*' seen
+	// and the name position it's currently matched up to.
+	const char* star_p = nullptr;
+	const char* star_s = nullptr;
+
+	while (s < send)
+	{
+		if (p < pend)
+		{
+			if (*p == '*')
+			{
+				star_p = ++p;
+				star_s = s;
+				continue;
+			}
+
+			if (*p == '?')
+			{
+				p++;
+				s++;
+				continue;
+			}
+
+			bool matched;
+			const char* next = p + 1;
+
+			if (*p == '[')
+			{
+				matched = match_class(p, pend, *s, next);
+				if (next == nullptr)
+				{
+					matched = (*s == '[');
+					next = p + 1;
+				}
+			}
+			else if (*p == '\\' && p + 1 < pend)
+			{
+				matched = (p[1] == *s);
+				next = p + 2;
+			}
+			else
+				matched = (*p == *s);
+
+			if (matched)
+			{
+				p = next;
+				s++;
+				continue;
+			}
+		}
+
+		if (star_p == nullptr)
+			return false;
+
+		p = star_p;
+		s = ++star_s;
+	}
+
+	while (p < pend && *p == '*')
+		p++;
+
+	return p == pend;
+}
+
+// Returns the unescaped literal runs of a glob.
+std::vector<std::string> literal_parts(const std::string& glob)
+{
+	std::vector<std::string> parts(1);
+
+	for (size_t i = 0; i < glob.length(); i++)
+	{
+		char c = glob[i];
+		if (c == '\\' && i + 1 < glob.length())
+		{
+			parts.back() += glob[++i];
+			continue;
+		}
+
+		if (!is_special(c))
+		{
+			parts.back() += c;
+			continue;
+		}
+
+		if (c == '[')
+		{
+			const char* next;
+			const char* p = glob.c_str() + i;
+			match_class(p, glob.c_str() + glob.length(), 0, next);
+			if (next == nullptr)
+			{
+				parts.back() += c;
+				continue;
+			}
+
+			i = next - glob.c_str() - 1;
+		}
+
+		if (!parts.back().empty())
+			parts.emplace_back();
+	}
+
+	return parts;
+}
+
+bool has_special(const std::string& s)
+{
+	for (char c : s)
+	{
+		if (is_special(c))
+			return true;
+	}
+
+	return false;
+}
+
+// Scratch buffer for lowering names, one per thread.
+std::string& lowered_buffer()
+{
+	static thread_local std::string buf;
+	return buf;
+}
+
+// Collects the matches of a walking thread and hands them
+// over to the callback.
+class Search_visitor
+{
+private:
+	const Search_query* m_query;
+	bool m_need_stat;
+	bool m_follow;
+
+	Result_batch<Search_result> m_batch;
+
+public:
+	Search_visitor(const Search_query& query,
+				   Batch_sink<Search_result>& sink)
+		: m_query(&query), m_batch{sink}
+	{
+		m_need_stat = query.min_size != 0
+			|| query.max_size != std::numeric_limits<uintmax_t>::max()
+			|| query.newer_than != std::numeric_limits<time_t>::min()
+			|| query.older_than != std::numeric_limits<time_t>::max();
+		m_follow = (query.walk.symlinks == Walk_options::Symlinks::follow);
+	}
+
+	Walk_action visit(const Walk_entry& e)
+	{
+		if (m_query->name.matches(e.name) && filter(e))
+			m_batch.add({e.path(), e.type});
+
+		if (m_query->max_depth >= 0 && e.level >= m_query->max_depth)
+			return Walk_action::skip;
+
+		return Walk_action::enter;
+	}
+
+	// Unreadable directories are silently left out, like find does
+	// except for the message.
+	void error(const Path&, int) {}
+
+	// Sparse matches don't wait for the next one.
+	void leave(const Path&)
+	{
+		m_batch.flush_if_due();
+	}
+
+	void merge(Search_visitor& v)
+	{
+		v.flush();
+	}
+
+	void flush()
+	{
+		m_batch.flush();
+	}
+
+private:
+	bool filter(const Walk_entry& e) const
+	{
+		if (m_query->type != DT_UNKNOWN && e.type != m_query->type)
+			return false;
+
+		if (!m_need_stat)
+			return true;
+
+		// The type of a followed symlink is its target's.
+		int err;
+		unsigned fields = stat_size | stat_mtime;
+		Stat st = (m_follow) ? status(e.path(), fields, err)
+			: symlink_status(e.path(), fields, err);
+		if (err)
+			return false;
+
+		if (e.type == DT_REG && (uintmax_t(st.st_size) < m_query->min_size
+								 || uintmax_t(st.st_size) > m_query->max_size))
+			return false;
+
+		time_t t = last_write_time(st);
+		return m_query->newer_than <= t && t <= m_query->older_than;
+	}
+};
+
+} // unnamed-namespace
+
+Name_pattern::Name_pattern(const std::string& pattern, bool regex,
+						   bool ignore_case)
+	: m_ignore_case{ignore_case}
+{
+	if (pattern.empty() || (!regex && pattern == "*"))
+	{
+		m_kind = Kind::any;
+		return;
+	}
+
+	if (regex)
+	{
+		auto flags = std::regex::ECMAScript | std::regex::optimize;
+		if (ignore_case) flags |= std::regex::icase;
+
+		m_kind = Kind::regex;
+		m_regex = std::make_shared<std::regex>(pattern, flags);
+		return;
+	}
+
+	m_pattern = pattern;
+	if (ignore_case)
+	{
+		for (char& c : m_pattern)
+			c = std::tolower(static_cast<unsigned char>(c));
+	}
+
+	std::vector<std::string> parts = literal_parts(m_pattern);
+	for (const std::string& part : parts)
+	{
+		if (part.length() > m_literal.length())
+			m_literal = part;
+	}
+
+	// Recognise the shapes that need no glob matching.
+	std::string body = m_pattern;
+	bool lead = (body.front() == '*');
+	bool trail = (body.length() > 1 && body.back() == '*'
+				  && body[body.length() - 2] != '\\');
+
+	if (lead) body.erase(0, 1);
+	if (trail) body.pop_back();
+
+	if (has_special(body))
+		m_kind = Kind::glob;
+	else if (lead && trail)
+		m_kind = Kind::contains;
+	else if (lead)
+		m_kind = Kind::suffix;
+	else if (trail)
+		m_kind = Kind::prefix;
+	else
+		m_kind = Kind::exact;
+
+	if (m_kind != Kind::glob)
+		m_literal = body;
+}
+
+bool Name_pattern::matches(const char* name, size_t len) const
+{
+	switch (m_kind)
+	{
+	case Kind::any:
+		return true;
+	case Kind::regex:
+		return std::regex_search(name, name + len, *m_regex);
+	default:
+		break;
+	}
+
+	if (!m_ignore_case)
+		return matches_lowered(name, len);
+
+	std::string& buf = lowered_buffer();
+	buf.assign(name, len);
+	for (char& c : buf)
+		c = std::tolower(static_cast<unsigned char>(c));
+
+	return matches_lowered(buf.data(), len);
+}
+
+// name is already lowered if the match ignores case.
+bool Name_pattern::matches_lowered(const char* name, size_t len) const
+{
+	const std::string& lit = m_literal;
+
+	switch (m_kind)
+	{
+	case Kind::exact:
+		return len == lit.length() && memcmp(name, lit.data(), len) == 0;
+	case Kind::prefix:
+		return len >= lit.length()
+			&& memcmp(name, lit.data(), lit.length()) == 0;
+	case Kind::suffix:
+		return len >= lit.length()
+			&& memcmp(name + len - lit.length(), lit.data(),
+					  lit.length()) == 0;
+	case Kind::contains:
+		return memmem(name, len, lit.data(), lit.length()) != nullptr;
+	default:
+		break;
+	}
+
+	if (!lit.empty() && memmem(name, len, lit.data(), lit.length()) == nullptr)
+		return false;
+
+	return glob_match(m_pattern.data(), m_pattern.data() + m_pattern.length(),
+					  name, name + len);
+}
+
+void search(const Path& root, const Search_query& query,
+			const Search_callback& fn)
+{
+	Batch_sink<Search_result> sink {fn};
+	Search_visitor visitor = parallel_walk(root, query.walk,
+										   Search_visitor{query, sink});
+	visitor.flush();
+}
+
+} // namespace hawk
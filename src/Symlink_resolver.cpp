@@ -0,0 +1,262 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cerrno>
+#include "Symlink_resolver.h"
+
+namespace hawk {
+
+namespace {
+
+// The limit of the kernel (MAXSYMLINKS).
+constexpr int max_symlink_depth = 40;
+
+void split(const std::string& p, std::string& dir, std::string& name)
+{
+	size_t pos = p.rfind('/');
+	if (pos == std::string::npos)
+	{
+		dir = ".";
+		name = p;
+	}
+	else
+	{
+		dir = (pos == 0) ? "/" : p.substr(0, pos);
+		name = p.substr(pos + 1);
+	}
+}
+
+std::string join(const std::string& dir, const std::string& name)
+{
+	return (dir == "/") ? dir + name : dir + '/' + name;
+}
+
+// Names which can be looked up in the directory as they are.
+bool is_plain_name(const std::string& name)
+{
+	return !name.empty() && name != "." && name != "..";
+}
+
+Path real_path(const std::string& p, int& err)
+{
+	char buf[PATH_MAX];
+	if (realpath(p.c_str(), buf) == nullptr)
+	{
+		err = errno;
+		return Path {};
+	}
+
+	err = 0;
+	return Path {buf};
+}
+
+} // unnamed-namespace
+
+Path Symlink_resolver::resolve(const Path& link, int& err)
+{
+	std::string dir, name;
+	split(link.string(), dir, name);
+	if (!is_plain_name(name))
+		return real_path(link.string(), err);
+
+	Stat st = status(Path{dir}, stat_ino, err);
+	if (err)
+		return Path {};
+
+	const Link& l = resolve({st.st_dev, st.st_ino}, dir, name, 0);
+	err = l.err;
+
+	return l.target;
+}
+
+void Symlink_resolver::clear()
+{
+	m_dirs.clear();
+	m_links.clear();
+}
+
+const Symlink_resolver::Link& Symlink_resolver::resolve(
+		const Id& dir_id, const std::string& dir, const std::string& name,
+		int depth)
+{
+	auto key = std::make_pair(dir_id, name);
+	auto it = m_links.find(key);
+	if (it != m_links.end())
+		return it->second;
+
+	Link l {Path{}, 0};
+	std::string path = join(canonical_directory(dir_id, dir, l.err), name);
+	Stat st;
+
+	if (!l.err)
+		st = symlink_status(Path{path}, stat_type, l.err);
+
+	if (!l.err && !is_symlink(st))
+		l.target = Path{path};
+	else if (!l.err && depth >= max_symlink_depth)
+		l.err = ELOOP;
+	else if (!l.err)
+	{
+		// Resolve the target the same way, through its directory.
+		Path target = read_symlink(Path{path}, l.err);
+		std::string t = (target.is_absolute()) ? target.string()
+			: join(path.substr(0, path.length() - name.length() - 1),
+				   target.string());
+
+		std::string t_dir, t_name;
+		split(t, t_dir, t_name);
+
+		if (!l.err && !is_plain_name(t_name))
+			l.target = real_path(t, l.err);
+		else if (!l.err)
+		{
+			Stat dst = status(Path{t_dir}, stat_ino, l.err);
+			if (!l.err)
+			{
+				const Link& tl = resolve({dst.st_dev, dst.st_ino}, t_dir,
+										 t_name, depth + 1);
+				l.target = tl.target;
+				l.err = tl.err;
+			}
+		}
+	}
+
+	return m_links.emplace(std::move(key), std::move(l)).first->second;
+}
+
+const std::string& Symlink_resolver::canonical_directory(
+		const Id& id, const std::string& dir, int& err)
+{
+	static const std::string none;
+
+	auto it = m_dirs.find(id);
+	if (it != m_dirs.end())
+	{
+		err = 0;
+		return it->second;
+	}
+
+	Path p = real_path(dir, err);
+	if (err)
+		return none;
+
+	return m_dirs.emplace(id, p.string()).first->second;
+}
+
+bool Visited_directories::insert(const Stat& st)
+{
+	return m_dirs.emplace(st.st_dev, st.st_ino).second;
+}
+
+void Visited_directories::insert_ancestors(const Path& p)
+{
+	std::string dir = p.string();
+	for (;;)
+	{
+		int err;
+		Stat st = status(Path{dir}, stat_ino, err);
+		if (!err && S_ISDIR(st.st_mode))
+			insert(st);
+
+		size_t pos = dir.rfind('/');
+		if (pos == std::string::npos || dir == "/")
+			break;
+
+		dir.resize((pos == 0) ? 1 : pos);
+	}
+}
+
+bool Visited_directories::contains(const Path& p) const
+{
+	int err;
+	Stat st = status(p, stat_ino, err);
+
+	return !err && S_ISDIR(st.st_mode)
+		&& m_dirs.count({st.st_dev, st.st_ino}) != 0;
+}
+
+void Visited_directories::clear()
+{
+	m_dirs.clear();
+}
+
+void Ancestor_directories::push(const Stat& st)
+{
+	m_dirs.emplace_back(st.st_dev, st.st_ino);
+}
+
+void Ancestor_directories::push_ancestors(const Path& p)
+{
+	std::vector<std::pair<dev_t, ino_t>> dirs;
+	std::string dir = p.string();
+	for (bool first = true;; first = false)
+	{
+		int err;
+		// A symlink isn't a directory the walk is in,
+		// its ancestors are resolved though.
+		Stat st = (first) ? symlink_status(Path{dir}, stat_ino, err)
+						  : status(Path{dir}, stat_ino, err);
+		if (!err && S_ISDIR(st.st_mode))
+			dirs.emplace_back(st.st_dev, st.st_ino);
+
+		size_t pos = dir.rfind('/');
+		if (pos == std::string::npos || dir == "/")
+			break;
+
+		dir.resize((pos == 0) ? 1 : pos);
+	}
+
+	// The deepest directory goes last, so that leave() pops it first.
+	m_dirs.insert(m_dirs.end(), dirs.rbegin(), dirs.rend());
+}
+
+void Ancestor_directories::set_top()
+{
+	m_top = m_dirs.size();
+}
+
+void Ancestor_directories::leave(int level)
+{
+	size_t size = m_top + level;
+	if (size < m_dirs.size())
+		m_dirs.resize(size);
+}
+
+bool Ancestor_directories::contains(const Path& p) const
+{
+	int err;
+	Stat st = status(p, stat_ino, err);
+
+	return !err && S_ISDIR(st.st_mode)
+		&& std::find(m_dirs.begin(), m_dirs.end(),
+					 std::make_pair(st.st_dev, st.st_ino)) != m_dirs.end();
+}
+
+void Ancestor_directories::clear()
+{
+	m_dirs.clear();
+	m_top = 0;
+}
+
+} // namespace hawk
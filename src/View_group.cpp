@@ -40,12 +40,17 @@ void check_and_rollback_path(Path& p, const Path& old_p)
 {
 	if (is_readable(p)) return; // We're good to go.
 
-	p = old_p; // Roll back to the previous path.
-	if (is_readable(p)) return;
+	// Roll back to the previous path (unless it's the one just checked).
+	if (p.string() != old_p.string())
+	{
+		p = old_p;
+		if (is_readable(p)) return;
+	}
 
 	// Otherwise roll back to the parent directory until it's readable.
-	while (!is_readable(p))
+	do
 		p.set_parent_path();
+	while (!p.empty() && !is_readable(p));
 
 	if (p.empty())
 		p = "/";
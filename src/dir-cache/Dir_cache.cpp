@@ -27,7 +27,7 @@
 #include "dir-cache/Cache_storage.h"
 #include "dir-watchdog/Dir_watchdog.h"
 #include "dir-watchdog/Poll_monitor.h"
-#include "dir-watchdog/Inotify_monitor.h"
+#include "dir-watchdog/Fanotify_monitor.h"
 
 namespace hawk {
 
@@ -46,6 +46,8 @@ struct
 } callbacks;
 
 std::unique_ptr<Cache_storage> storage;
+Size_cache sizes;
+std::shared_ptr<Name_index> name_index;
 
 void watch_directory(const Path& p)
 {
@@ -62,6 +64,12 @@ void watch_directory(const Path& p)
 void watchdog_notify(Monitor::Event ev, const Path& p)
 {
 	storage->mark_dirty(p);
+	sizes.invalidate(p, ev == Monitor::Event::deleted);
+
+	std::shared_ptr<Name_index> index = std::atomic_load(&name_index);
+	if (index)
+		index->update(p, ev == Monitor::Event::deleted);
+
 	callbacks.on_fs_change(p);
 }
 
@@ -101,7 +109,9 @@ void start_filesystem_watchdog(std::chrono::milliseconds update_interval,
 		// TODO: choose the right native Monitor type (depending on the system)
 		// at compile-time.
 
-		auto native_mon = std::make_unique<Inotify_monitor>(update_interval);
+		// Fanotify_monitor falls back to inotify if it can't mark
+		// the filesystems.
+		auto native_mon = std::make_unique<Fanotify_monitor>(update_interval);
 		watchdog.native = std::make_unique<Dir_watchdog>(
 					std::move(native_mon), &watchdog_notify);
 	}
@@ -118,4 +128,19 @@ void load_dir_ptr(Dir_ptr& ptr, const Path& directory, bool force_reload)
 	watch_directory(directory);
 }
 
+Tree_size directory_size(const Path& directory)
+{
+	return sizes.get(directory);
+}
+
+bool cached_directory_size(const Path& directory, Tree_size& size)
+{
+	return sizes.find(directory, size);
+}
+
+void set_name_index(std::shared_ptr<Name_index> index)
+{
+	std::atomic_store(&name_index, std::move(index));
+}
+
 } // namespace hawk
@@ -111,6 +111,11 @@ void populate_directory(Dir_vector& vec, const Path& dir)
 		Dir_entry ent;
 		ent.path = *it;
 
+		// The type is only a hint, don't fail on entries which
+		// vanished in the meantime.
+		int err;
+		ent.type = it.type(err);
+
 		vec.push_back(std::move(ent));
 	}
 
@@ -0,0 +1,853 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Parallel_walker.h"
+#include "dir-cache/Name_index.h"
+
+namespace hawk {
+
+namespace {
+
+constexpr char magic[8] = {'H', 'A', 'W', 'K', 'N', 'I', 'X', '1'};
+// Number of paths in a block, a path is found by decoding its block
+// from the beginning.
+constexpr uint64_t block_size = 32;
+
+struct Header
+{
+	char magic[8];
+	uint64_t count;
+	uint64_t root_length; // The root follows the header.
+	uint64_t blocks;
+	uint64_t block_table; // Offsets of the blocks.
+	uint64_t trigrams;
+	uint64_t trigram_table; // Sorted Trigram_entries.
+};
+
+struct Trigram_entry
+{
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t offset; // Delta-coded indices of the paths.
+};
+
+std::string normalize(const Path& p)
+{
+	std::string s = p.string();
+	while (s.length() > 1 && s.back() == '/')
+		s.pop_back();
+
+	return s;
+}
+
+std::string join(const std::string& dir, const char* name)
+{
+	return (dir == "/") ? dir + name : dir + '/' + name;
+}
+
+// The paths of a sub-tree of dir are those in [first, last).
+void subtree_bounds(const std::string& dir, std::string& first,
+					std::string& last)
+{
+	first = (dir == "/") ? dir : dir + '/';
+	last = first;
+	last.back() = '/' + 1;
+}
+
+char ascii_lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+template <typename Fn>
+void for_each_trigram(const char* s, size_t len, Fn fn)
+{
+	for (size_t i = 0; i + 3 <= len; i++)
+	{
+		fn(uint32_t(static_cast<unsigned char>(ascii_lower(s[i]))) << 16
+		   | uint32_t(static_cast<unsigned char>(ascii_lower(s[i + 1]))) << 8
+		   | uint32_t(static_cast<unsigned char>(ascii_lower(s[i + 2]))));
+	}
+}
+
+size_t name_position(const std::string& p)
+{
+	size_t slash = p.rfind('/');
+	return (slash == std::string::npos) ? 0 : slash + 1;
+}
+
+void put_varint(std::string& out, uint64_t v)
+{
+	while (v >= 0x80)
+	{
+		out += char(v | 0x80);
+		v >>= 7;
+	}
+
+	out += char(v);
+}
+
+// Returns false if the varint doesn't end before end (or is too long).
+bool get_varint(const char*& p, const char* end, uint64_t& v)
+{
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7)
+	{
+		unsigned char b = *p++;
+		v |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return true;
+	}
+
+	return false;
+}
+
+void align(std::string& out)
+{
+	out.resize((out.size() + 7) & ~size_t(7));
+}
+
+void write_file(const Path& file, const std::string& data)
+{
+	int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				  0644);
+	if (fd == -1)
+		throw Filesystem_error {file, errno};
+
+	const char* p = data.data();
+	size_t left = data.size();
+	while (left > 0)
+	{
+		ssize_t n = ::write(fd, p, left);
+		if (n < 0)
+		{
+			if (errno == EINTR) continue;
+
+			int err = errno;
+			close(fd);
+			throw Filesystem_error {file, err};
+		}
+
+		p += n;
+		left -= n;
+	}
+
+	if (fdatasync(fd) != 0)
+	{
+		int err = errno;
+		close(fd);
+		throw Filesystem_error {file, err};
+	}
+
+	close(fd);
+}
+
+// Returns the image of the index file.
+std::string encode(const std::string& root,
+				   const std::vector<std::string>& paths)
+{
+	std::string out(sizeof(Header), '\0');
+	out += root;
+
+	std::vector<uint64_t> blocks;
+	std::vector<uint64_t> trigrams;
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		const std::string& p = paths[i];
+
+		size_t shared = 0;
+		if (i % block_size == 0)
+			blocks.push_back(out.size());
+		else
+		{
+			const std::string& prev = paths[i - 1];
+			size_t n = std::min(p.length(), prev.length());
+			while (shared < n && p[shared] == prev[shared])
+				shared++;
+		}
+
+		put_varint(out, shared);
+		put_varint(out, p.length() - shared);
+		out.append(p, shared, std::string::npos);
+
+		size_t pos = name_position(p);
+		for_each_trigram(p.c_str() + pos, p.length() - pos,
+						 [&trigrams, i](uint32_t t) {
+							 trigrams.push_back(uint64_t(t) << 32 | i);
+						 });
+	}
+
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()),
+				   trigrams.end());
+
+	Header h;
+	memcpy(h.magic, magic, sizeof(magic));
+	h.count = paths.size();
+	h.root_length = root.length();
+	h.blocks = blocks.size();
+
+	align(out);
+	h.block_table = out.size();
+	out.append(reinterpret_cast<const char*>(blocks.data()),
+			   blocks.size() * sizeof(uint64_t));
+
+	std::vector<Trigram_entry> table;
+	std::string postings;
+	uint64_t prev = 0;
+	for (uint64_t t : trigrams)
+	{
+		uint32_t trigram = t >> 32;
+		uint64_t id = t & 0xffffffff;
+
+		if (table.empty() || table.back().trigram != trigram)
+		{
+			table.push_back({trigram, 0, postings.size()});
+			prev = 0;
+		}
+
+		table.back().count++;
+		put_varint(postings, id - prev);
+		prev = id;
+	}
+
+	h.trigram_table = out.size();
+	h.trigrams = table.size();
+	uint64_t postings_start = h.trigram_table
+		+ table.size() * sizeof(Trigram_entry);
+
+	for (Trigram_entry& e : table)
+		e.offset += postings_start;
+
+	out.append(reinterpret_cast<const char*>(table.data()),
+			   table.size() * sizeof(Trigram_entry));
+	out += postings;
+	memcpy(&out[0], &h, sizeof(h));
+
+	return out;
+}
+
+// Indexes the tree under dir on the calling thread.
+void collect_tree(const std::string& dir, std::vector<std::string>& out)
+{
+	std::vector<std::string> dirs {dir};
+	while (!dirs.empty())
+	{
+		hard_interruption_point();
+
+		std::string d = std::move(dirs.back());
+		dirs.pop_back();
+
+		int err;
+		Directory_iterator it {Path{d}, err};
+		while (!err && !it.at_end())
+		{
+			out.push_back(join(d, it.name()));
+			if (it.type(err) == DT_DIR && !err)
+				dirs.push_back(out.back());
+
+			it.increment(err);
+		}
+	}
+}
+
+class Path_collector
+{
+private:
+	std::vector<std::string> m_paths;
+
+public:
+	Walk_action visit(const Walk_entry& e)
+	{
+		m_paths.push_back(e.path().string());
+		return Walk_action::enter;
+	}
+
+	void error(const Path&, int) {}
+	void leave(const Path&) {}
+
+	void merge(Path_collector& c)
+	{
+		m_paths.insert(m_paths.end(),
+					   std::make_move_iterator(c.m_paths.begin()),
+					   std::make_move_iterator(c.m_paths.end()));
+	}
+
+	std::vector<std::string>& paths() { return m_paths; }
+};
+
+} // unnamed-namespace
+
+Name_index::Name_index(const Path& file)
+	: m_file{file}
+{
+	map_file();
+}
+
+Name_index::~Name_index()
+{
+	{
+		std::lock_guard<std::mutex> lk {m_queue_mtx};
+		m_stop = true;
+	}
+
+	m_queue_cv.notify_one();
+	m_updater.hard_interrupt();
+	if (m_updater.joinable())
+		m_updater.join();
+
+	unmap_file();
+}
+
+void Name_index::build(const Path& root, const Walk_options& opts)
+{
+	std::string r = normalize(root);
+	Path_collector c = parallel_walk(Path{r}, opts, Path_collector{});
+
+	std::vector<std::string>& paths = c.paths();
+	std::sort(paths.begin(), paths.end());
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	std::lock_guard<std::mutex> lk {m_write_mtx};
+	write(r, paths);
+}
+
+void Name_index::save()
+{
+	// The changes are only made under m_write_mtx,
+	// m_mtx isn't needed for reading.
+	std::lock_guard<std::mutex> lk {m_write_mtx};
+	if (m_root.empty())
+		return;
+
+	std::vector<std::string> stored;
+	stored.reserve(m_count - m_removed_count);
+	decode(0, m_count, [this, &stored](uint64_t i, const std::string& p) {
+		if (m_removed.empty() || !m_removed[i])
+			stored.push_back(p);
+		return true;
+	});
+
+	std::vector<std::string> paths;
+	paths.reserve(stored.size() + m_added.size());
+	std::merge(stored.begin(), stored.end(), m_added.begin(), m_added.end(),
+			   std::back_inserter(paths));
+	paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+	write(m_root, paths);
+}
+
+void Name_index::update(const Path& dir, bool deleted)
+{
+	std::string d = normalize(dir);
+
+	std::lock_guard<std::mutex> lk {m_queue_mtx};
+	auto it = std::find_if(m_queue.begin(), m_queue.end(),
+		[&d](const std::pair<std::string, bool>& u) {
+			return u.first == d;
+		});
+
+	if (it != m_queue.end())
+		it->second = it->second || deleted;
+	else
+		m_queue.emplace_back(std::move(d), deleted);
+
+	if (!m_updater.joinable())
+		m_updater = Interruptible_thread {[this] { process_updates(); }};
+
+	m_queue_cv.notify_one();
+}
+
+void Name_index::process_updates()
+{
+	for (;;)
+	{
+		std::pair<std::string, bool> u;
+		{
+			std::unique_lock<std::mutex> lk {m_queue_mtx};
+			m_queue_cv.wait(lk, [this] {
+				return m_stop || !m_queue.empty();
+			});
+
+			if (m_stop)
+				return;
+
+			u = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		// A failed update (e.g. out of memory) only leaves
+		// the index out of date.
+		try { apply_update(u.first, u.second); }
+		catch (const Hard_thread_interrupt&) { throw; }
+		catch (...) {}
+	}
+}
+
+void Name_index::apply_update(const std::string& d, bool deleted)
+{
+	std::vector<std::pair<std::string, unsigned char>> entries;
+	if (!deleted)
+	{
+		int err;
+		Directory_iterator it {Path{d}, err};
+		if (err == ENOENT || err == ENOTDIR)
+			deleted = true;
+		else if (err)
+			return;
+
+		while (!deleted && !it.at_end())
+		{
+			unsigned char type = it.type(err);
+			entries.emplace_back(it.name(), err ? DT_UNKNOWN : type);
+
+			it.increment(err);
+			if (err)
+				return;
+		}
+	}
+
+	std::vector<std::string> new_dirs;
+	{
+		std::lock_guard<std::mutex> wlk {m_write_mtx};
+		std::lock_guard<std::mutex> lk {m_mtx};
+		if (m_root.empty() || (d != m_root && m_root != "/"
+							   && d.compare(0, m_root.length() + 1,
+											m_root + '/') != 0))
+			return;
+
+		if (deleted)
+		{
+			if (d != m_root)
+				remove(d);
+			remove_tree(d);
+			return;
+		}
+
+		std::set<std::string> indexed = indexed_children(d);
+		for (const auto& e : entries)
+		{
+			if (indexed.erase(e.first) != 0)
+				continue;
+
+			std::string child = join(d, e.first.c_str());
+			m_added.insert(child);
+			if (e.second == DT_DIR)
+				new_dirs.push_back(std::move(child));
+		}
+
+		// What's left has been removed.
+		for (const std::string& name : indexed)
+		{
+			std::string child = join(d, name.c_str());
+			remove(child);
+			remove_tree(child);
+		}
+	}
+
+	for (const std::string& nd : new_dirs)
+	{
+		std::vector<std::string> paths;
+		collect_tree(nd, paths);
+
+		std::lock_guard<std::mutex> wlk {m_write_mtx};
+		std::lock_guard<std::mutex> lk {m_mtx};
+		remove_tree(nd);
+		m_added.insert(paths.begin(), paths.end());
+	}
+}
+
+std::vector<Path> Name_index::find(const Name_pattern& pattern,
+								   size_t limit) const
+{
+	std::vector<std::string> found;
+	auto match = [&pattern](const std::string& p) {
+		size_t pos = name_position(p);
+		return pattern.matches(p.c_str() + pos, p.length() - pos);
+	};
+
+	std::lock_guard<std::mutex> lk {m_mtx};
+
+	auto add_stored = [&](uint64_t i, const std::string& p) {
+		if ((m_removed.empty() || !m_removed[i]) && match(p))
+			found.push_back(p);
+		return limit == 0 || found.size() < limit;
+	};
+
+	const std::string& lit = pattern.literal();
+	if (m_count != 0 && lit.length() >= 3)
+	{
+		const Header* h = reinterpret_cast<const Header*>(m_data);
+		const Trigram_entry* table =
+			reinterpret_cast<const Trigram_entry*>(m_data + h->trigram_table);
+		const Trigram_entry* table_end = table + h->trigrams;
+
+		// Posting lists of the literal's trigrams, shortest first.
+		std::vector<const Trigram_entry*> lists;
+		bool missing = false;
+		for_each_trigram(lit.data(), lit.length(), [&](uint32_t t) {
+			const Trigram_entry* e = std::lower_bound(table, table_end, t,
+				[](const Trigram_entry& e, uint32_t t) {
+					return e.trigram < t;
+				});
+
+			if (e == table_end || e->trigram != t)
+				missing = true;
+			else
+				lists.push_back(e);
+		});
+
+		std::sort(lists.begin(), lists.end());
+		lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+		std::sort(lists.begin(), lists.end(),
+				  [](const Trigram_entry* a, const Trigram_entry* b) {
+					  return a->count < b->count;
+				  });
+
+		std::vector<uint64_t> candidates;
+		std::vector<uint64_t> list;
+		const char* end = m_data + m_size;
+		for (size_t i = 0; !missing && i < lists.size(); i++)
+		{
+			list.clear();
+			const char* p = m_data + lists[i]->offset;
+			uint64_t id = 0;
+			uint64_t delta;
+			for (uint32_t j = 0; j < lists[i]->count
+					 && get_varint(p, end, delta); j++)
+			{
+				// Corrupted lists are cut short.
+				id += delta;
+				if (id >= m_count)
+					break;
+
+				list.push_back(id);
+			}
+
+			if (i == 0)
+				candidates.swap(list);
+			else
+			{
+				auto end = std::set_intersection(
+					candidates.begin(), candidates.end(),
+					list.begin(), list.end(), candidates.begin());
+				candidates.erase(end, candidates.end());
+			}
+		}
+
+		if (!missing)
+		{
+			bool more = true;
+			for (size_t i = 0; more && i < candidates.size(); i++)
+			{
+				decode(candidates[i], candidates[i] + 1,
+					   [&](uint64_t id, const std::string& p) {
+						   return more = add_stored(id, p);
+					   });
+			}
+		}
+	}
+	else
+		decode(0, m_count, add_stored);
+
+	std::vector<std::string> added;
+	for (const std::string& p : m_added)
+	{
+		if (limit != 0 && added.size() >= limit)
+			break;
+
+		if (match(p))
+			added.push_back(p);
+	}
+
+	size_t stored = found.size();
+	found.insert(found.end(), added.begin(), added.end());
+	std::inplace_merge(found.begin(), found.begin() + stored, found.end());
+
+	if (limit != 0 && found.size() > limit)
+		found.resize(limit);
+
+	std::vector<Path> paths;
+	paths.reserve(found.size());
+	for (std::string& p : found)
+		paths.emplace_back(std::move(p));
+
+	return paths;
+}
+
+Path Name_index::root() const
+{
+	std::lock_guard<std::mutex> lk {m_mtx};
+	return Path{m_root};
+}
+
+size_t Name_index::size() const
+{
+	std::lock_guard<std::mutex> lk {m_mtx};
+	return m_count - m_removed_count + m_added.size();
+}
+
+void Name_index::map_file()
+{
+	int fd = open(m_file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	struct stat64 st;
+	if (fstat64(fd, &st) != 0 || size_t(st.st_size) < sizeof(Header))
+	{
+		close(fd);
+		return;
+	}
+
+	void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return;
+
+	m_data = static_cast<const char*>(data);
+	m_size = st.st_size;
+
+	const Header* h = reinterpret_cast<const Header*>(m_data);
+	bool valid = memcmp(h->magic, magic, sizeof(magic)) == 0
+		&& h->root_length <= m_size - sizeof(Header)
+		&& h->blocks == h->count / block_size + (h->count % block_size != 0)
+		&& h->block_table >= sizeof(Header) + h->root_length
+		&& h->block_table <= m_size && h->block_table % 8 == 0
+		&& h->blocks <= (m_size - h->block_table) / sizeof(uint64_t)
+		&& h->trigram_table <= m_size && h->trigram_table % 8 == 0
+		&& h->trigrams <= (m_size - h->trigram_table)
+							/ sizeof(Trigram_entry);
+
+	// The paths are only decoded up to the block table and the posting
+	// lists up to the end of the file, the blocks and the lists have to
+	// start there.
+	if (valid)
+	{
+		const uint64_t* blocks =
+			reinterpret_cast<const uint64_t*>(m_data + h->block_table);
+		for (uint64_t b = 0; valid && b < h->blocks; b++)
+		{
+			valid = blocks[b] >= sizeof(Header) + h->root_length
+				&& blocks[b] < h->block_table
+				&& (b == 0 || blocks[b] > blocks[b - 1]);
+		}
+
+		const Trigram_entry* table = reinterpret_cast<const Trigram_entry*>(
+			m_data + h->trigram_table);
+		uint64_t postings_start =
+			h->trigram_table + h->trigrams * sizeof(Trigram_entry);
+		for (uint64_t t = 0; valid && t < h->trigrams; t++)
+		{
+			valid = table[t].offset >= postings_start
+				&& table[t].offset < m_size
+				&& (t == 0 || table[t].trigram > table[t - 1].trigram);
+		}
+	}
+
+	if (!valid)
+	{
+		unmap_file();
+		return;
+	}
+
+	m_root.assign(m_data + sizeof(Header), h->root_length);
+	m_count = h->count;
+}
+
+void Name_index::unmap_file()
+{
+	if (m_data)
+		munmap(const_cast<char*>(m_data), m_size);
+
+	m_data = nullptr;
+	m_size = 0;
+	m_count = 0;
+	m_root.clear();
+}
+
+void Name_index::write(const std::string& root,
+					   const std::vector<std::string>& paths)
+{
+	std::string out = encode(root, paths);
+
+	// Replace the file as a whole, the old one is still mapped.
+	Path tmp {m_file.string() + ".tmp"};
+	write_file(tmp, out);
+	if (rename(tmp.c_str(), m_file.c_str()) != 0)
+		throw Filesystem_error {m_file, errno};
+
+	std::lock_guard<std::mutex> lk {m_mtx};
+	unmap_file();
+	map_file();
+	m_root = root;
+
+	m_removed.clear();
+	m_removed_count = 0;
+	m_added.clear();
+}
+
+uint64_t Name_index::lower_bound(const std::string& s) const
+{
+	if (m_count == 0)
+		return 0;
+
+	const Header* h = reinterpret_cast<const Header*>(m_data);
+	const uint64_t* blocks =
+		reinterpret_cast<const uint64_t*>(m_data + h->block_table);
+
+	// The first path of a block is stored as a whole.
+	const char* end = m_data + h->block_table;
+	auto first_path_greater = [this, end](const std::string& s, uint64_t off) {
+		const char* p = m_data + off;
+		uint64_t shared, len;
+		if (!get_varint(p, end, shared) || !get_varint(p, end, len)
+			|| len > uint64_t(end - p))
+			len = 0;
+
+		return s.compare(0, std::string::npos, p, len) < 0;
+	};
+
+	const uint64_t* b = std::upper_bound(blocks, blocks + h->blocks, s,
+										 first_path_greater);
+	if (b == blocks)
+		return 0;
+
+	uint64_t first = (b - blocks - 1) * block_size;
+	uint64_t last = std::min(first + block_size, m_count);
+	uint64_t result = last;
+	decode(first, last, [&s, &result](uint64_t i, const std::string& p) {
+		if (p.compare(s) < 0)
+			return true;
+
+		result = i;
+		return false;
+	});
+
+	return result;
+}
+
+template <typename Fn>
+void Name_index::decode(uint64_t first, uint64_t last, Fn fn) const
+{
+	if (first >= last)
+		return;
+
+	const Header* h = reinterpret_cast<const Header*>(m_data);
+	const uint64_t* blocks =
+		reinterpret_cast<const uint64_t*>(m_data + h->block_table);
+
+	// The paths of a corrupted file end early.
+	const char* end = m_data + h->block_table;
+	last = std::min(last, m_count);
+
+	std::string path;
+	const char* p = nullptr;
+	for (uint64_t i = first - first % block_size; i < last; i++)
+	{
+		if (i % block_size == 0)
+			p = m_data + blocks[i / block_size];
+
+		uint64_t shared, len;
+		if (!get_varint(p, end, shared) || !get_varint(p, end, len)
+			|| shared > path.length() || len > uint64_t(end - p))
+			return;
+
+		path.resize(shared);
+		path.append(p, len);
+		p += len;
+
+		if (i >= first && !fn(i, path))
+			return;
+	}
+}
+
+void Name_index::remove(const std::string& p)
+{
+	m_added.erase(p);
+
+	uint64_t i = lower_bound(p);
+	if (i >= m_count)
+		return;
+
+	decode(i, i + 1, [this, &p](uint64_t i, const std::string& s) {
+		if (s == p)
+			mark_removed(i);
+		return false;
+	});
+}
+
+void Name_index::remove_tree(const std::string& p)
+{
+	std::string first, last;
+	subtree_bounds(p, first, last);
+
+	m_added.erase(m_added.lower_bound(first), m_added.lower_bound(last));
+
+	uint64_t end = lower_bound(last);
+	for (uint64_t i = lower_bound(first); i < end; i++)
+		mark_removed(i);
+}
+
+void Name_index::mark_removed(uint64_t i)
+{
+	if (m_removed.empty())
+		m_removed.resize(m_count);
+
+	if (!m_removed[i])
+	{
+		m_removed[i] = true;
+		m_removed_count++;
+	}
+}
+
+std::set<std::string> Name_index::indexed_children(const std::string& dir) const
+{
+	std::string first, last;
+	subtree_bounds(dir, first, last);
+
+	std::set<std::string> names;
+	auto add = [&names, &first](const std::string& p) {
+		if (p.find('/', first.length()) == std::string::npos)
+			names.insert(p.substr(first.length()));
+	};
+
+	decode(lower_bound(first), lower_bound(last),
+		   [this, &add](uint64_t i, const std::string& p) {
+			   if (m_removed.empty() || !m_removed[i])
+				   add(p);
+			   return true;
+		   });
+
+	for (auto it = m_added.lower_bound(first);
+		 it != m_added.end() && *it < last; ++it)
+		add(*it);
+
+	return names;
+}
+
+} // namespace hawk
@@ -0,0 +1,295 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <vector>
+#include "Filesystem.h"
+#include "Parallel_walker.h"
+#include "dir-cache/Size_cache.h"
+
+namespace hawk {
+
+namespace {
+
+using Size_map = std::unordered_map<std::string, Tree_size>;
+
+std::string normalize(const Path& p)
+{
+	std::string s = p.string();
+	while (s.length() > 1 && s.back() == '/')
+		s.pop_back();
+
+	return s;
+}
+
+// Returns the length of the parent directory's path within p.
+size_t parent_length(const std::string& p, size_t len)
+{
+	size_t pos = p.rfind('/', len - 1);
+	if (pos == std::string::npos)
+		return 0;
+
+	return (pos == 0) ? 1 : pos;
+}
+
+void add(Tree_size& to, const Tree_size& from)
+{
+	to.bytes += from.bytes;
+	to.files += from.files;
+	to.dirs += from.dirs;
+}
+
+// Sums up the entries of every directory, not including
+// the contents of its sub-directories.
+class Size_visitor
+{
+private:
+	Size_map m_dirs;
+
+	// The directory of the previous entry, the entries of a directory
+	// are visited one after another by the same thread.
+	std::string m_cur_dir;
+	Tree_size* m_cur = nullptr;
+
+public:
+	Size_visitor() {}
+	// m_cur points into the other visitor's map.
+	Size_visitor(const Size_visitor& v) : m_dirs(v.m_dirs) {}
+
+	Walk_action visit(const Walk_entry& e)
+	{
+		const std::string& p = e.path().string();
+		Tree_size& parent = parent_sizes(p);
+
+		if (e.type == DT_DIR)
+		{
+			parent.dirs++;
+			m_dirs[p];
+
+			return Walk_action::enter;
+		}
+
+		parent.files++;
+		if (e.type == DT_REG)
+		{
+			int err;
+			Stat st = symlink_status(e.path(), stat_size, err);
+			if (!err)
+				parent.bytes += st.st_size;
+		}
+
+		return Walk_action::enter;
+	}
+
+	// Unreadable directories simply don't count.
+	void error(const Path&, int) {}
+	void leave(const Path&) {}
+
+	void merge(Size_visitor& v)
+	{
+		for (const auto& d : v.m_dirs)
+			add(m_dirs[d.first], d.second);
+	}
+
+	Size_map& sizes() { return m_dirs; }
+
+private:
+	Tree_size& parent_sizes(const std::string& p)
+	{
+		size_t len = parent_length(p, p.length());
+
+		if (!m_cur || m_cur_dir.length() != len
+			|| m_cur_dir.compare(0, len, p, 0, len) != 0)
+		{
+			m_cur_dir.assign(p, 0, len);
+			m_cur = &m_dirs[m_cur_dir];
+		}
+
+		return *m_cur;
+	}
+};
+
+// Adds the sizes of every directory to its ancestors up to root.
+Size_map accumulate(const Size_map& own, const std::string& root)
+{
+	Size_map totals = own;
+
+	for (const auto& d : own)
+	{
+		std::string dir = d.first;
+		while (dir.length() > root.length())
+		{
+			dir.resize(parent_length(dir, dir.length()));
+			add(totals[dir], d.second);
+		}
+	}
+
+	return totals;
+}
+
+// Drops the size of p and its ancestors, whose sizes include p's.
+// If p has been deleted, the sizes of its sub-directories as well.
+template <typename Map>
+void drop(Map& sizes, std::string p, bool deleted)
+{
+	if (deleted)
+	{
+		std::string prefix = (p == "/") ? p : p + '/';
+		for (auto it = sizes.begin(); it != sizes.end();)
+		{
+			if (it->first.compare(0, prefix.length(), prefix) == 0)
+				it = sizes.erase(it);
+			else
+				++it;
+		}
+	}
+
+	for (;;)
+	{
+		sizes.erase(p);
+
+		size_t len = parent_length(p, p.length());
+		if (len == 0 || len >= p.length())
+			break;
+
+		p.resize(len);
+	}
+}
+
+} // unnamed-namespace
+
+Tree_size Size_cache::get(const Path& dir)
+{
+	std::string root = normalize(dir);
+	Clock::time_point start = Clock::now();
+	std::list<Pending_walk>::iterator walk;
+
+	{
+		std::lock_guard<std::mutex> lk {m_mtx};
+		auto it = m_sizes.find(root);
+		if (it != m_sizes.end() && !expired(it->second, start))
+			return it->second.size;
+
+		walk = m_pending.emplace(m_pending.end());
+	}
+
+	Size_map own;
+	try {
+		own = std::move(parallel_walk(Path{root}, Walk_options{},
+									  Size_visitor{}).sizes());
+	} catch (...) {
+		std::lock_guard<std::mutex> lk {m_mtx};
+		m_pending.erase(walk);
+		throw;
+	}
+	own[root];
+
+	Size_map totals = accumulate(own, root);
+	Tree_size size = totals[root];
+
+	std::lock_guard<std::mutex> lk {m_mtx};
+	Pending_walk pending = std::move(*walk);
+	m_pending.erase(walk);
+
+	if (pending.cleared)
+		return size;
+
+	// The directories changed during the walk may have been counted
+	// before or after the change, the rest of the tree is still valid.
+	for (const auto& i : pending.invalidated)
+		drop(totals, i.first, i.second);
+
+	// A tree too big for the cache only keeps
+	// the sizes of root and its sub-directories.
+	bool shallow = (totals.size() > m_max_entries);
+	for (auto& d : totals)
+	{
+		if (shallow && d.first != root
+			&& parent_length(d.first, d.first.length()) != root.length())
+			continue;
+
+		m_sizes[d.first] = {d.second, start};
+	}
+
+	m_walks.push_back(start);
+	evict();
+
+	return size;
+}
+
+bool Size_cache::find(const Path& dir, Tree_size& size)
+{
+	std::lock_guard<std::mutex> lk {m_mtx};
+	auto it = m_sizes.find(normalize(dir));
+	if (it == m_sizes.end() || expired(it->second, Clock::now()))
+		return false;
+
+	size = it->second.size;
+	return true;
+}
+
+void Size_cache::invalidate(const Path& dir, bool deleted)
+{
+	std::string p = normalize(dir);
+
+	std::lock_guard<std::mutex> lk {m_mtx};
+	for (Pending_walk& w : m_pending)
+		w.invalidated.emplace_back(p, deleted);
+
+	drop(m_sizes, std::move(p), deleted);
+}
+
+void Size_cache::clear()
+{
+	std::lock_guard<std::mutex> lk {m_mtx};
+	for (Pending_walk& w : m_pending)
+		w.cleared = true;
+
+	m_sizes.clear();
+	m_walks.clear();
+}
+
+bool Size_cache::expired(const Entry& e, Clock::time_point now) const
+{
+	return now - e.time > m_max_age;
+}
+
+void Size_cache::evict()
+{
+	Clock::time_point now = Clock::now();
+
+	// The entries of a walk share its start time, the ones
+	// overwritten by a later walk are kept.
+	while (!m_walks.empty() && (m_sizes.size() > m_max_entries
+								|| now - m_walks.front() > m_max_age))
+	{
+		Clock::time_point oldest = m_walks.front();
+		m_walks.pop_front();
+
+		for (auto it = m_sizes.begin(); it != m_sizes.end();)
+		{
+			if (it->second.time <= oldest)
+				it = m_sizes.erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+} // namespace hawk
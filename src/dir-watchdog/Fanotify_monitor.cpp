@@ -0,0 +1,413 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include <algorithm>
+#include <system_error>
+#include <thread>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+#include "Filesystem.h"
+#include "dir-watchdog/Dir_watchdog.h"
+#include "dir-watchdog/Fanotify_monitor.h"
+
+namespace hawk {
+
+namespace {
+
+constexpr uint64_t mark_mask = FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM
+	| FAN_MOVED_TO | FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR;
+// Marked on the watched directories themselves.
+constexpr uint64_t dir_mark_mask = FAN_MODIFY | FAN_EVENT_ON_CHILD;
+
+constexpr size_t fsid_size = sizeof(__kernel_fsid_t);
+
+std::string handle_key(const void* fsid, const file_handle& fh)
+{
+	std::string key {static_cast<const char*>(fsid), fsid_size};
+	key.append(reinterpret_cast<const char*>(&fh.handle_type),
+			   sizeof(fh.handle_type));
+	key.append(reinterpret_cast<const char*>(fh.f_handle), fh.handle_bytes);
+
+	return key;
+}
+
+// Returns the topmost directory above dir on the same filesystem.
+Path filesystem_root(const Path& dir)
+{
+	int err;
+	Stat st = status(dir, err);
+	if (err)
+		return dir;
+
+	Path root = dir;
+	for (;;)
+	{
+		Path parent = root.parent_path();
+		if (parent.empty() || parent.string_equals(root))
+			break;
+
+		Stat pst = status(parent, err);
+		if (err || pst.st_dev != st.st_dev)
+			break;
+
+		root = std::move(parent);
+	}
+
+	return root;
+}
+
+bool has_name(int info_type)
+{
+	return info_type == FAN_EVENT_INFO_TYPE_DFID_NAME
+		|| info_type == FAN_EVENT_INFO_TYPE_OLD_DFID_NAME
+		|| info_type == FAN_EVENT_INFO_TYPE_NEW_DFID_NAME;
+}
+
+} // unnamed-namespace
+
+Fanotify_monitor::Fanotify_monitor(std::chrono::milliseconds timeout)
+	: m_timeout{timeout}, m_last_broadcast{Clock::now()}
+{
+	m_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME
+						 | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC);
+
+	m_pfd.fd = m_fd;
+	m_pfd.events = POLLIN;
+	m_pfd.revents = 0;
+}
+
+Fanotify_monitor::~Fanotify_monitor()
+{
+	// Closing the fd removes the marks.
+	if (m_fd != -1)
+		close(m_fd);
+}
+
+void Fanotify_monitor::add_path(const Path& dir)
+{
+	const std::string& p = dir.string();
+	if (m_keys.count(p) != 0 || m_fallback_paths.count(p) != 0)
+		return;
+
+	if (m_fd == -1)
+	{
+		add_fallback_path(dir);
+		return;
+	}
+
+	struct statfs st;
+	if (statfs(dir.c_str(), &st) < 0)
+		throw std::system_error {errno, std::system_category(), "statfs failed"};
+
+	union
+	{
+		file_handle fh;
+		char buf[sizeof(file_handle) + MAX_HANDLE_SZ];
+	} h;
+
+	h.fh.handle_bytes = MAX_HANDLE_SZ;
+	int mount_id;
+	std::string fsid {reinterpret_cast<const char*>(&st.f_fsid), fsid_size};
+
+	// Filesystems without file handles can't report events either.
+	// Symlinks are followed like by the marks.
+	if (name_to_handle_at(AT_FDCWD, dir.c_str(), &h.fh, &mount_id,
+						  AT_SYMLINK_FOLLOW) < 0
+		|| !mark_filesystem(fsid, dir))
+	{
+		add_fallback_path(dir);
+		return;
+	}
+
+	// E.g. the limit of marks has been reached.
+	if (fanotify_mark(m_fd, FAN_MARK_ADD, dir_mark_mask,
+					  AT_FDCWD, dir.c_str()) < 0)
+	{
+		unmark_filesystem(fsid);
+		add_fallback_path(dir);
+		return;
+	}
+
+	std::string key = handle_key(&st.f_fsid, h.fh);
+	Watch& w = m_watches[key];
+	if (w.paths.empty())
+		w.ev = Event::none;
+
+	w.paths.push_back(dir);
+	m_keys[p] = key;
+	m_marks[fsid].watches++;
+}
+
+void Fanotify_monitor::remove_path(const Path& dir)
+{
+	const std::string& p = dir.string();
+	if (m_fallback_paths.erase(p) != 0)
+	{
+		m_fallback->remove_path(dir);
+		return;
+	}
+
+	auto it = m_keys.find(p);
+	if (it == m_keys.end())
+		return;
+
+	std::string fsid = it->second.substr(0, fsid_size);
+	auto w = m_watches.find(it->second);
+	m_keys.erase(it);
+
+	if (w != m_watches.end())
+	{
+		std::vector<Path>& paths = w->second.paths;
+		paths.erase(std::remove(paths.begin(), paths.end(), dir), paths.end());
+		if (paths.empty())
+		{
+			// Fails if the directory is gone, the mark is gone as well then.
+			fanotify_mark(m_fd, FAN_MARK_REMOVE, dir_mark_mask,
+						  AT_FDCWD, dir.c_str());
+			m_watches.erase(w);
+		}
+	}
+
+	auto mark = m_marks.find(fsid);
+	if (mark != m_marks.end())
+	{
+		mark->second.watches--;
+		unmark_filesystem(fsid);
+	}
+}
+
+void Fanotify_monitor::watch() noexcept
+{
+	if (m_fd == -1)
+	{
+		if (m_fallback)
+			m_fallback->watch();
+		else
+			std::this_thread::sleep_for(m_timeout);
+
+		return;
+	}
+
+	// The fallback waits for its own events, otherwise wait until
+	// the next broadcast is due at the latest.
+	int timeout = 0;
+	if (!m_fallback)
+	{
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+			m_last_broadcast + m_timeout - Clock::now());
+		timeout = std::max<int>(left.count(), 0);
+	}
+
+	int ready = poll(&m_pfd, 1, timeout);
+
+	// Interrupted (EINTR), the events are read in the next pass.
+	if (ready < 0)
+		return;
+	if (ready > 0)
+		read_events();
+
+	// A steady stream of events mustn't hold the notifications back.
+	if (ready == 0 || Clock::now() - m_last_broadcast >= m_timeout)
+		broadcast_notifications();
+
+	if (m_fallback)
+		m_fallback->watch();
+}
+
+void Fanotify_monitor::add_fallback_path(const Path& dir)
+{
+	if (!m_fallback)
+	{
+		m_fallback = std::make_unique<Inotify_monitor>(m_timeout);
+		m_fallback->set_parent(*m_watchdog);
+	}
+
+	m_fallback->add_path(dir);
+	m_fallback_paths.insert(dir.string());
+}
+
+bool Fanotify_monitor::mark_filesystem(const std::string& fsid,
+									   const Path& dir)
+{
+	auto it = m_marks.find(fsid);
+	if (it != m_marks.end())
+		return it->second.marked;
+
+	bool marked = fanotify_mark(m_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+								mark_mask, AT_FDCWD, dir.c_str()) == 0;
+	m_marks[fsid] = {marked, 0, (marked) ? filesystem_root(dir) : Path{}};
+
+	return marked;
+}
+
+void Fanotify_monitor::unmark_filesystem(const std::string& fsid)
+{
+	auto it = m_marks.find(fsid);
+	if (it == m_marks.end() || it->second.watches != 0)
+		return;
+
+	// A filesystem which couldn't be marked stays in m_marks,
+	// so that it isn't tried again for every directory.
+	if (!it->second.marked)
+		return;
+
+	fanotify_mark(m_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+				  mark_mask, AT_FDCWD, it->second.root.c_str());
+	m_marks.erase(it);
+}
+
+void Fanotify_monitor::read_events() noexcept
+{
+	alignas(fanotify_event_metadata) char buf[16384];
+	ssize_t len = read(m_fd, buf, sizeof(buf));
+	if (len < 0)
+	{
+		// Anything else could have lost events.
+		if (errno != EAGAIN && errno != EINTR)
+			set_all_modified();
+
+		return;
+	}
+
+	auto ev = reinterpret_cast<const fanotify_event_metadata*>(buf);
+	for (; FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len))
+	{
+		if (ev->vers != FANOTIFY_METADATA_VERSION)
+			continue;
+
+		if (ev->mask & FAN_Q_OVERFLOW)
+		{
+			set_all_modified();
+			continue;
+		}
+
+		const char* p = reinterpret_cast<const char*>(ev);
+		process_event(ev->mask, p + ev->metadata_len, p + ev->event_len);
+	}
+}
+
+void Fanotify_monitor::process_event(uint64_t mask, const char* info,
+									 const char* end)
+{
+	while (info + sizeof(fanotify_event_info_header) <= end)
+	{
+		auto hdr = reinterpret_cast<const fanotify_event_info_header*>(info);
+		if (hdr->len == 0)
+			break;
+
+		info += hdr->len;
+
+		int type = hdr->info_type;
+		if (type != FAN_EVENT_INFO_TYPE_FID && type != FAN_EVENT_INFO_TYPE_DFID
+			&& !has_name(type))
+			continue;
+
+		auto fid = reinterpret_cast<const fanotify_event_info_fid*>(hdr);
+		auto fh = reinterpret_cast<const file_handle*>(fid->handle);
+
+		auto it = m_watches.find(handle_key(&fid->fsid, *fh));
+		if (it == m_watches.end())
+			continue;
+
+		Watch& w = it->second;
+		if (!has_name(type))
+		{
+			// An event on the watched directory itself.
+			if (mask & (FAN_DELETE_SELF | FAN_MOVE_SELF))
+			{
+				w.ev = Event::deleted;
+				for (const Path& p : w.paths)
+					set_event(p.parent_path().string(), Event::modified);
+			}
+			else if (w.ev == Event::none)
+				w.ev = Event::modified;
+
+			continue;
+		}
+
+		if (w.ev == Event::none)
+			w.ev = Event::modified;
+
+		// A sub-directory is gone, it might be watched as well
+		// (the self events aren't guaranteed to be in the same batch).
+		if ((mask & FAN_ONDIR) && (mask & (FAN_DELETE | FAN_MOVED_FROM)))
+		{
+			const char* name = reinterpret_cast<const char*>(fh->f_handle)
+				+ fh->handle_bytes;
+
+			// set_event() doesn't touch the paths.
+			for (const Path& p : w.paths)
+				set_event((p / name).string(), Event::deleted);
+		}
+	}
+}
+
+void Fanotify_monitor::set_event(const std::string& dir, Event ev)
+{
+	auto it = m_keys.find(dir);
+	if (it == m_keys.end())
+		return;
+
+	auto w = m_watches.find(it->second);
+	if (w != m_watches.end() && w->second.ev != Event::deleted)
+		w->second.ev = ev;
+}
+
+void Fanotify_monitor::set_all_modified()
+{
+	// Events have been lost, anything could have changed.
+	for (auto& pair : m_watches)
+	{
+		if (pair.second.ev == Event::none)
+			pair.second.ev = Event::modified;
+	}
+}
+
+void Fanotify_monitor::broadcast_notifications()
+{
+	m_last_broadcast = Clock::now();
+
+	std::vector<Path> deleted;
+	for (auto& pair : m_watches)
+	{
+		Watch& w = pair.second;
+		if (w.ev == Event::none)
+			continue;
+
+		for (const Path& p : w.paths)
+		{
+			m_watchdog->_notify(w.ev, p);
+			if (w.ev == Event::deleted)
+				deleted.push_back(p);
+		}
+
+		w.ev = Event::none;
+	}
+
+	// Deleted directories have to be removed from the queue.
+	for (const Path& p : deleted)
+		remove_path(p);
+}
+
+} // namespace hawk
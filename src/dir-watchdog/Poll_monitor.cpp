@@ -24,8 +24,16 @@
 
 namespace hawk {
 
+namespace {
+
+// Cached attributes are good enough for polling, there's no need to
+// make a network filesystem ask the server each time.
+constexpr unsigned poll_fields = stat_mtime | stat_dont_sync;
+
+} // unnamed-namespace
+
 Poll_monitor::Entry::Entry(const Path& p)
-	: path{p}, timestamp{last_write_time(p)}
+	: path{p}, timestamp{last_write_time(status(p, poll_fields))}
 {}
 
 void Poll_monitor::add_path(const Path& dir)
@@ -47,21 +55,26 @@ void Poll_monitor::remove_path(const Path& dir)
 
 void Poll_monitor::watch() noexcept
 {
-	for (auto it = m_entries.begin(); it != m_entries.end(); ++it)
+	for (auto it = m_entries.begin(); it != m_entries.end();)
 	{
 		int err;
-		time_t current_timestamp = last_write_time(it->path, err);
+		Stat st = status(it->path, poll_fields, err);
 
 		if (err)
 		{
 			m_watchdog->_notify(Event::deleted, it->path);
-			m_entries.erase(it);
+			it = m_entries.erase(it);
+			continue;
 		}
-		else if (it->timestamp < current_timestamp)
+
+		time_t current_timestamp = last_write_time(st);
+		if (it->timestamp < current_timestamp)
 		{
 			m_watchdog->_notify(Event::modified, it->path);
 			it->timestamp = current_timestamp;
 		}
+
+		++it;
 	}
 
 	std::this_thread::sleep_for(m_delay);
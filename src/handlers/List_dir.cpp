@@ -192,7 +192,7 @@ void List_dir::set_path(const Path& dir)
 		return;
 	}
 
-	Stat st = status(dir);
+	Stat st = status(dir, stat_mode);
 
 	if (!is_directory(st))
 		throw Filesystem_error {dir, ENOTDIR};
@@ -0,0 +1,75 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HAWK_BULK_STATUS_H
+#define HAWK_BULK_STATUS_H
+
+#include <vector>
+#include <functional>
+#include <cstddef>
+#include "Filesystem.h"
+
+namespace hawk {
+	struct Bulk_status_options
+	{
+		// Fields to fetch, see Stat_fields.
+		unsigned fields = stat_basic;
+		bool follow_symlinks = false;
+		// Number of bytes to read from the start of regular files
+		// (e.g. for MIME sniffing), 0 reads nothing.
+		size_t head_size = 0;
+		// Number of names queried at once.
+		unsigned depth = 64;
+	};
+
+	struct Bulk_status_result
+	{
+		// Index of the name in the list passed in.
+		size_t index;
+		// errno of the query, st is valid only if it's 0.
+		int err;
+		Stat st;
+		// Start of the file, valid only during the callback. head_err
+		// is the errno of opening or reading it.
+		const char* head;
+		size_t head_len;
+		int head_err;
+	};
+
+	using Bulk_status_callback = std::function<void(const Bulk_status_result&)>;
+
+	// Queries the metadata of names relative to the directory dirfd
+	// with many requests in flight, so that high latency filesystems
+	// (NFS, FUSE) don't cost a round trip per name. Requests are
+	// submitted through io_uring, a pool of threads is used if it isn't
+	// available. fn is called on the calling thread as the results
+	// complete, i.e. in no particular order.
+	//
+	// Interrupting the calling thread (see Interrupt.h) cancels the
+	// queries, the ones in flight are waited for.
+	void bulk_status(int dirfd, const std::vector<const char*>& names,
+					 const Bulk_status_options& opts,
+					 const Bulk_status_callback& fn);
+	void bulk_status(const Path& dir, const std::vector<const char*>& names,
+					 const Bulk_status_options& opts,
+					 const Bulk_status_callback& fn);
+}
+
+#endif // HAWK_BULK_STATUS_H
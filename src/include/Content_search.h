@@ -0,0 +1,85 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef HAWK_CONTENT_SEARCH_H
+#define HAWK_CONTENT_SEARCH_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include <functional>
+#include "Filesystem.h"
+#include "Search.h"
+
+namespace hawk {
+	struct Content_query
+	{
+		// Literal strings to look for, a line matches if it contains
+		// any of them. Empty strings are ignored.
+		std::vector<std::string> patterns;
+		// Case is ignored for ASCII letters only.
+		bool ignore_case = false;
+		// Which files are searched.
+		Name_pattern name;
+		// Files containing a NUL byte near their beginning are skipped.
+		bool skip_binary = true;
+		uintmax_t max_file_size = std::numeric_limits<uintmax_t>::max();
+		// Maximum number of matching lines reported per file,
+		// zero is unlimited.
+		size_t max_hits = 0;
+		// Zero searches only the files in the root, -1 is unlimited.
+		int max_depth = -1;
+		// Threads, symlink and filesystem policy of the walk.
+		Walk_options walk;
+	};
+
+	struct Content_hit
+	{
+		Path path;
+		// Counted from 1.
+		uintmax_t line;
+		// Offset of the match in the file.
+		uintmax_t offset;
+		// The matching line (without the newline), shortened around
+		// the match if it's too long.
+		std::string text;
+		// Position and length of the match in text.
+		size_t column;
+		size_t length;
+	};
+
+	using Content_callback =
+		std::function<void(const std::vector<Content_hit>& hits)>;
+
+	// Searches the contents of the regular files under root on several
+	// threads (see parallel_walk()). Files are read sequentially in large
+	// chunks and every matching line is reported once. Hits are handed
+	// to fn in batches as they're found, fn is called by the walking
+	// threads, one at a time. Unreadable files are silently skipped.
+	//
+	// The search is cancelled by interrupting the calling thread, e.g.
+	// by running another task on the same Tasking.
+	void search_contents(const Path& root, const Content_query& query,
+						 const Content_callback& fn);
+}
+
+#endif // HAWK_CONTENT_SEARCH_H
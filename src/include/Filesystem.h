@@ -25,6 +25,8 @@
 #include <stdexcept>
 #include <cstring>
 #include <deque>
+#include <vector>
+#include <string>
 #include <dirent.h>
 #include <sys/stat.h>
 #include "Path.h"
@@ -35,28 +37,83 @@ namespace hawk {
 	{
 	public:
 		using value_type = Path;
-		using iterator_category = std::forward_iterator_tag;
+		using iterator_category = std::input_iterator_tag;
 		using difference_type = int;
 		using pointer = Path*;
 		using reference = Path&;
 
 	private:
-		struct Dir_guard
+		// Entries are read in batches with getdents64 into buf.
+		struct Dir_state
 		{
-			DIR* d;
-			dirent* ent;
-			~Dir_guard() { closedir(d); delete [] ent; }
+			static constexpr size_t buf_size = 32 * 1024;
+
+			int fd;
+			size_t off; // Offset of the next entry in buf.
+			size_t len; // Number of valid bytes in buf.
+			dirent64* ent;
+			long pos; // Position of ent in the directory stream.
+			long next; // Position of the entry following ent.
+			alignas(dirent64) char buf[buf_size];
+
+			// Moves the stream to pos (see tell()).
+			void seek(long pos) noexcept;
+			// Reads the next entry into ent. Returns false at the end
+			// of the directory or on failure (err is set).
+			bool read(int& err) noexcept;
 		};
 
-		std::shared_ptr<Dir_guard> m_dir;
+		// Closes the directory, the state itself is kept for reuse by
+		// the next iterator created by the releasing thread.
+		struct Dir_release
+		{
+			void operator()(Dir_state* dir) const noexcept;
+		};
+
+		std::unique_ptr<Dir_state, Dir_release> m_dir;
+
+		static constexpr size_t max_cached_states = 16;
+
+		// Takes over fd, returns nullptr if out of memory.
+		static Dir_state* acquire_state(int fd) noexcept;
+		// nullptr once the thread's cache has been destroyed (e.g. when
+		// an iterator is destroyed by a later thread_local destructor).
+		static std::vector<Dir_state*>* state_cache() noexcept;
 
 		friend class Recursive_directory_iterator;
 
 	public:
 		constexpr Directory_iterator() {}
 		explicit Directory_iterator(const Path& p);
+		Directory_iterator(const Path& p, int& err);
+		// Opens the directory p and positions the iterator at the entry
+		// `name' which is expected to be at pos (see tell()). If it's not
+		// there anymore, it's looked up by its name. If it has been removed
+		// in the meantime, the iterator is positioned at pos.
+		Directory_iterator(const Path& p, long pos, const char* name,
+						   int& err);
+
+		// Iterators are move-only, use clone() to get an independent
+		// iterator positioned at the same entry. It reopens the directory
+		// through the open one, so the directory may even be renamed
+		// in the meantime.
+		Directory_iterator(Directory_iterator&&) noexcept = default;
+		Directory_iterator& operator=(Directory_iterator&&) noexcept
+			= default;
+
+		Directory_iterator clone() const;
+		Directory_iterator clone(int& err) const noexcept;
 
 		Path operator*() const;
+		// Returns the name of the current entry without copying it.
+		const char* name() const;
+
+		// Returns the type of the current entry as one of the DT_*
+		// constants without following symlinks. The type is taken from
+		// the directory stream, only filesystems which don't fill it in
+		// (DT_UNKNOWN) cost an fstatat.
+		unsigned char type() const;
+		unsigned char type(int& err) const noexcept;
 
 		bool operator==(const Directory_iterator& it) const;
 		bool operator!=(const Directory_iterator& it) const;
@@ -64,7 +121,14 @@ namespace hawk {
 		// Returns true if there are no more items to iterate.
 		bool at_end() const;
 
+		// Returns the position of the current entry in the directory
+		// stream or -1 if the iterator is at its end.
+		long tell() const;
+
 		Directory_iterator& operator++();
+		// Same as operator++ but reports errors through err instead of
+		// throwing. On failure the iterator is set to its end state.
+		Directory_iterator& increment(int& err) noexcept;
 
 		// Advances this iterator until it either reaches
 		// target or becomes null.
@@ -80,17 +144,69 @@ namespace hawk {
 		using pointer = Directory_iterator::pointer;
 		using reference = Directory_iterator::reference;
 
+		// Position of the iterator which can be used to restore it without
+		// re-walking the tree. For every level of recursion it stores the
+		// position of the current entry in the directory stream along with
+		// its name used to validate the position. It's plain data and as
+		// such it may be stored persistently.
+		struct Checkpoint
+		{
+			struct Level
+			{
+				long pos;
+				std::string name;
+			};
+
+			Path root;
+			std::vector<Level> levels;
+
+			bool empty() const { return levels.empty(); }
+		};
+
 	private:
-		std::deque<std::pair<Path, Directory_iterator>> m_iter_stack;
+		// Full path of the current entry, it's updated in place as the
+		// iterator moves. Every level stores the length of the path of
+		// its directory.
+		Path m_path;
+		size_t m_root_len = 0;
+		std::deque<std::pair<size_t, Directory_iterator>> m_iter_stack;
 
 	public:
 		Recursive_directory_iterator() {}
 		explicit Recursive_directory_iterator(const Path& p);
+		Recursive_directory_iterator(const Path& p, int& err);
+		// Restores the iterator from a checkpoint. Only the directories on
+		// the path to the current entry are opened and seeked, i.e. the cost
+		// doesn't depend on the number of entries iterated through before
+		// the checkpoint was made.
+		explicit Recursive_directory_iterator(const Checkpoint& cp);
+		Recursive_directory_iterator(const Checkpoint& cp, int& err);
+
+		Checkpoint checkpoint() const;
+
+		// Like Directory_iterator this one is move-only, clone() gets an
+		// independent iterator at the same entry without re-walking.
+		Recursive_directory_iterator(Recursive_directory_iterator&&)
+			= default;
+		Recursive_directory_iterator& operator=(
+				Recursive_directory_iterator&&) = default;
+
+		Recursive_directory_iterator clone() const;
+		Recursive_directory_iterator clone(int& err) const;
 
 		// Returns path relative to the top directory.
 		Path operator*() const;
 		// Returns only the filename.
 		Path top() const;
+		// The full path (i.e. prefixed with the top directory) and the
+		// relative path of the current entry. Unlike operator*, these
+		// don't allocate, the values are valid until the iterator moves.
+		const Path& path() const { return m_path; }
+		const char* relative_path() const;
+		// Returns the type of the current entry (see
+		// Directory_iterator::type()).
+		unsigned char type() const;
+		unsigned char type(int& err) const noexcept;
 
 		bool operator==(const Recursive_directory_iterator& it) const;
 		bool operator!=(const Recursive_directory_iterator& it) const;
@@ -104,54 +220,93 @@ namespace hawk {
 
 		void leave_directory();
 
+		// Descends into the current entry if it's a directory. Symlinks
+		// to directories aren't followed.
 		Recursive_directory_iterator& operator++();
 		// Increment without entering a sub-directory.
 		Recursive_directory_iterator& orthogonal_increment();
 
+		// Non-throwing variants of the two methods above. Unlike
+		// operator++, these always move the iterator forward: a
+		// sub-directory that cannot be entered is skipped and a directory
+		// that fails to be read is treated as exhausted. err holds
+		// the errno of such failure or 0.
+		Recursive_directory_iterator& increment(int& err);
+		Recursive_directory_iterator& orthogonal_increment(int& err);
+
 		// Advances this iterator until it either reaches
-		// target or becomes null.
+		// target or becomes null. Prefer restoring from a Checkpoint.
 		void advance(const Recursive_directory_iterator& target);
 
 	private:
+		void restore(const Checkpoint& cp, int& err, Path& failed);
 		inline void increment() { ++m_iter_stack.back().second; }
+		// Enters the directory the iterator points to, it becomes
+		// the new top of the stack.
+		void push(Directory_iterator&& it);
+		void update_path();
 		void resolve_empty_directories();
+		void resolve_empty_directories(int& err);
 	};
 
+	// The error message is formatted upon construction, what() may be
+	// called from several threads (e.g. through an exception_ptr).
+	// The hot paths report errno instead of throwing this.
 	class Filesystem_error : public std::exception
 	{
 	private:
 		Path m_path;
-		std::string m_what;
 		int m_errno;
+		std::string m_what;
 
 	public:
 		Filesystem_error(const Path& p, int err)
-			: m_path{p}, m_what{p.c_str()}, m_errno{err}
-		{
-			char msg[128];
-			msg[127] = '\0';
-			m_what += ": "; m_what += strerror_r(err, msg, 127);
-		}
+			: m_path{p}, m_errno{err}, m_what{format(p, err)}
+		{}
 
-		Filesystem_error(int err) : m_errno{err}
-		{
-			char msg[128];
-			msg[127] = '\0';
-			m_what = strerror_r(err, msg, 127);
-		}
+		Filesystem_error(int err)
+			: m_errno{err}, m_what{format(Path{}, err)}
+		{}
 
-		virtual const char* what() const noexcept
-		{
-			return m_what.c_str();
-		}
+		virtual const char* what() const noexcept;
 
 		const Path& get_source() const { return m_path; }
 		int get_errno() const { return m_errno; }
+
+	private:
+		static std::string format(const Path& p, int err);
 	};
 
 	// query functions
 
-	using Stat = struct stat64;
+	// Metadata of a file as returned by statx(). Only the fields
+	// requested (see Stat_fields) are guaranteed to be filled in,
+	// the device is always available.
+	struct Stat : stat64
+	{
+		// STATX_* flags of the fields that are valid.
+		unsigned mask;
+		// Creation time, valid if mask contains STATX_BTIME.
+		timespec st_btim;
+	};
+
+	// Fields to fetch by status() and symlink_status(), these can be
+	// or-ed together. Asking for less allows filesystems to skip work.
+	enum Stat_fields : unsigned
+	{
+		stat_type = STATX_TYPE,
+		stat_mode = STATX_TYPE | STATX_MODE,
+		stat_size = STATX_TYPE | STATX_SIZE,
+		stat_mtime = STATX_MTIME,
+		stat_btime = STATX_BTIME,
+		// st_dev and st_ino, e.g. to tell directories apart.
+		stat_ino = STATX_TYPE | STATX_INO,
+		stat_basic = STATX_BASIC_STATS,
+		stat_all = STATX_BASIC_STATS | STATX_BTIME,
+		// Network filesystems may return cached attributes instead of
+		// querying the server (AT_STATX_DONT_SYNC).
+		stat_dont_sync = 1u << 31
+	};
 
 	struct Space_info
 	{
@@ -162,10 +317,22 @@ namespace hawk {
 
 	bool exists(const Path& p);
 
+	// These fetch stat_basic unless fields are given.
 	Stat status(const Path& p);
 	Stat status(const Path& p, int& err) noexcept;
+	Stat status(const Path& p, unsigned fields);
+	Stat status(const Path& p, unsigned fields, int& err) noexcept;
 	Stat symlink_status(const Path& p);
 	Stat symlink_status(const Path& p, int& err) noexcept;
+	Stat symlink_status(const Path& p, unsigned fields);
+	Stat symlink_status(const Path& p, unsigned fields, int& err) noexcept;
+	// Same as the two above for name relative to the directory dirfd.
+	Stat status_at(int dirfd, const char* name, unsigned fields,
+				   int& err) noexcept;
+	Stat symlink_status_at(int dirfd, const char* name, unsigned fields,
+						   int& err) noexcept;
+	// Converts the result of a statx() call.
+	Stat make_stat(const struct statx& stx) noexcept;
 
 	bool is_readable(const Path& p) noexcept;
 	bool is_readable(const Stat& st) noexcept;
@@ -187,6 +354,10 @@ namespace hawk {
 
 	time_t last_write_time(const Path& p);
 	time_t last_write_time(const Path& p, int& err) noexcept;
+	time_t last_write_time(const Stat& st) noexcept;
+
+	// Returns -1 if the filesystem doesn't record creation times.
+	time_t creation_time(const Stat& st) noexcept;
 
 	int read_permissions(const Path& p);
 	int read_permissions(const Stat& st) noexcept;
@@ -200,12 +371,64 @@ namespace hawk {
 	Space_info space(const Path& p);
 	Space_info space(const Path& p, int& err) noexcept;
 
+	// A path along with its metadata. Only the fields asked for are
+	// fetched, on the first query that needs them, the other queries
+	// reuse them (an error is kept as well) until refresh().
+	class File_entry
+	{
+	private:
+		Path m_path;
+		Stat m_st;
+		// Fields asked for so far, the filesystem may not fill in all.
+		unsigned m_fields = 0;
+		int m_err = 0;
+		bool m_follow;
+
+	public:
+		// follow_symlinks chooses between status() and symlink_status().
+		explicit File_entry(const Path& p, bool follow_symlinks = true)
+			: m_path{p}, m_st{}, m_follow{follow_symlinks}
+		{}
+		// Adopts st fetched for p already (st.mask tells the fields).
+		File_entry(const Path& p, const Stat& st, bool follow_symlinks)
+			: m_path{p}, m_st(st), m_fields{st.mask},
+			  m_follow{follow_symlinks}
+		{}
+
+		const Path& path() const { return m_path; }
+
+		const Stat& stat(unsigned fields);
+		const Stat& stat(unsigned fields, int& err) noexcept;
+
+		bool exists() noexcept;
+
+		bool is_directory();
+		bool is_directory(int& err) noexcept;
+
+		bool is_regular_file();
+		bool is_regular_file(int& err) noexcept;
+
+		bool is_symlink();
+		bool is_symlink(int& err) noexcept;
+
+		// Drops the metadata, the next query fetches it again.
+		void refresh() noexcept
+		{
+			m_fields = 0;
+			m_err = 0;
+		}
+	};
+
 	// operational functions
 
 	void write_permissions(const Path& p, mode_t perms);
 	void write_permissions(const Path& p, mode_t perms, int& err) noexcept;
 
 	void copy_permissions(const Path& from, const Path& to);
+	void copy_permissions(const Path& from, const Path& to, int& err) noexcept;
+	// Reuses the mode of from if it has been fetched already.
+	void copy_permissions(File_entry& from, const Path& to);
+	void copy_permissions(File_entry& from, const Path& to, int& err) noexcept;
 
 	void create_directory(const Path& p);
 	void create_directory(const Path& p, int& err) noexcept;
@@ -231,6 +454,66 @@ namespace hawk {
 
 	// Remove a directory and its contents.
 	void remove_recursively(const Path& directory);
+
+	// tree walking
+
+	// What the walker does with an entry once it has been visited.
+	enum class Walk_action {enter, skip, stop};
+
+	struct Walk_options
+	{
+		enum class Symlinks
+		{
+			no_follow, // Symlinks are visited as such.
+			follow // Symlinks are visited as their targets, directories
+			       // reached more than once (e.g. loops) are entered once.
+		};
+
+		Symlinks symlinks = Symlinks::no_follow;
+		// Don't descend into directories on other filesystems than
+		// the one of the root.
+		bool same_filesystem = false;
+		// Number of walking threads, 0 means one per CPU.
+		unsigned threads = 0;
+	};
+
+	class Walk_entry
+	{
+	private:
+		Path& m_path;
+		size_t m_dir_length;
+		mutable bool m_built = false;
+
+	public:
+		// Name of the entry within its directory.
+		const char* name;
+		// One of the DT_* constants. It's the type of the target of
+		// a followed symlink, DT_LNK if the symlink is dangling.
+		unsigned char type;
+		// Zero for the entries of the root.
+		int level;
+
+		// path holds the directory (of dir_length) followed by anything.
+		Walk_entry(Path& path, size_t dir_length, const char* name,
+				   unsigned char type, int level)
+			: m_path(path), m_dir_length{dir_length}, name{name},
+			  type{type}, level{level}
+		{}
+
+		// Full path of the entry, it's only built if it's asked for
+		// and valid only during the visit.
+		const Path& path() const
+		{
+			if (!m_built)
+			{
+				m_path.truncate(m_dir_length);
+				m_path /= name;
+				m_built = true;
+			}
+
+			return m_path;
+		}
+	};
 }
 
 #endif // HAWK_FILESYSTEM_H
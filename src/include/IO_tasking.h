@@ -23,10 +23,16 @@
 #include <memory>
 #include <chrono>
 #include <deque>
+#include <list>
+#include <vector>
 #include <functional>
+#include <atomic>
 #include "Path.h"
 #include "Filesystem.h"
 #include "Interruptible_thread.h"
+#include "Spsc_ring.h"
+#include "IO_tuning.h"
+#include "Symlink_resolver.h"
 
 namespace hawk {
 	struct Task_progress
@@ -44,7 +50,12 @@ namespace hawk {
 	};
 
 	class IO_task;
+	// Writes a block to several destinations at once, see IO_tasking.cpp.
+	class Fanout;
 
+	// Task_progress_monitor is called from IO_task::drain_progress(),
+	// i.e. in the consumer's thread. File_progress_monitor is called
+	// by the IO task itself (about once per second).
 	using Task_progress_monitor =
 			std::function<void(IO_task*, const Task_progress&) noexcept>;
 	using File_progress_monitor =
@@ -69,6 +80,25 @@ namespace hawk {
 		int get_errno() const { return err; }
 	};
 
+	// Per-entry failures that occurred in a single directory. IO tasks
+	// collect errors of the entries they're walking through and report
+	// them in batches instead of one by one.
+	class IO_task_error_batch
+	{
+	private:
+		Path dir;
+		std::vector<IO_task_error> errors;
+
+	public:
+		void add(const Path& src, const Path& dst, int err);
+		void clear();
+		bool empty() const { return errors.empty(); }
+
+		// The directory containing the failed entries.
+		const Path& get_directory() const { return dir; }
+		const std::vector<IO_task_error>& get_errors() const { return errors; }
+	};
+
 	struct IO_task_fatal : public Filesystem_error
 	{
 		using Filesystem_error::Filesystem_error;
@@ -79,31 +109,126 @@ namespace hawk {
 	public:
 		enum class Status {preparing, pending, finished, failed, paused};
 
+		// How hard the task tries to get copied files onto the disk.
+		enum class Durability
+		{
+			// Leave the writeback to the kernel.
+			none,
+			// fdatasync() each file once it's been copied.
+			per_file,
+			// Start the writeback of each file while it's being copied
+			// and syncfs() the destination once at the end of the task.
+			batched,
+			// Like per_file, but a file is copied under a temporary name
+			// and renamed afterwards, so that after a crash a file can be
+			// found under its name only with all of its data. The
+			// destination is syncfs()'d at the end of the task and
+			// a moved file's source is removed only after its new
+			// directory entry has reached the disk.
+			ordered
+		};
+
+		// How copying treats the page cache. Copying a huge amount of data
+		// through it evicts everything else, e.g. the dentries and inodes
+		// which make browsing directories fast.
+		enum class Cache_mode
+		{
+			normal,
+			// Drop the pages of both the source and the destination
+			// behind the copy cursor once they've been written back.
+			drop_behind,
+			// Use O_DIRECT for large files, other files (or filesystems
+			// not supporting O_DIRECT) are copied as in drop_behind.
+			direct
+		};
+
+		// A destination a file is being copied to,
+		// err is the errno of its failure.
+		struct Copy_output
+		{
+			Path dst;
+			int err;
+		};
+
+		// A regular file which has been walked past but not copied yet.
+		struct Pending_file
+		{
+			Path src;
+			Path dst;
+			uintmax_t size;
+		};
+
+		// State of the item being processed (the front of the item queue)
+		// which is kept while the task is paused. dir_iter points to the
+		// entry being processed, offset is the number of bytes of the file
+		// being copied that have already been written. If pending isn't
+		// empty, its front is the file being copied instead. A file copied
+		// by ranges (see set_range_workers()) has the ranges which have
+		// already been copied marked in ranges, offset is then the number
+		// of bytes in them.
 		struct Context
 		{
 			uintmax_t offset;
 			Recursive_directory_iterator dir_iter;
 			std::chrono::steady_clock::time_point start;
+			std::deque<Pending_file> pending;
+			std::vector<char> ranges;
+
+			// Whether the file being copied has been copied partially.
+			bool file_started() const
+			{
+				return offset != 0 || !ranges.empty();
+			}
 		};
 
+		// ancestors are the directories above the symlink a dereferenced
+		// item has been queued by, the item is copied below them.
 		struct Item
 		{
 			Path src;
 			Path dst;
+			Ancestor_directories ancestors;
 
 			Item(const Path& s) : src{s} {}
 			Item(const Path& s, const Path& d) : src{s}, dst{d} {}
+			Item(const Path& s, const Path& d, const Ancestor_directories& a)
+				: src{s}, dst{d}, ancestors{a}
+			{}
 		};
 
 	protected:
 		Path m_dst;
+		// Refreshed on every run, m_dst may be created by the task.
+		File_entry m_dst_entry;
+
+		// A destination the data are copied to in addition to m_dst
+		// (see IO_task_copy::add_destination()). err is the errno which
+		// made the target unusable for the rest of the task.
+		struct Target
+		{
+			Path root;
+			int err;
+		};
+
+		std::vector<Target> m_targets;
 
 		bool m_check_avail_space;
 		bool m_deref_symlinks;
 		bool m_update_symlinks;
 
 		Context m_ctx;
-		std::deque<Item> m_items;
+		// A list, the front item is referred to while symlink targets
+		// are queued behind it.
+		std::list<Item> m_items;
+
+		// Symlinks resolved during the current run of the task.
+		Symlink_resolver m_symlinks;
+		// Directories above the entry being processed, a symlink to one
+		// of them isn't dereferenced (see handle_symlink()).
+		Ancestor_directories m_ancestors;
+		// Directories the space pre-scan has counted, so that one reached
+		// through several symlinks is counted once.
+		Visited_directories m_visited;
 
 	private:
 		uintmax_t m_total;
@@ -112,6 +237,26 @@ namespace hawk {
 
 		Interruptible_thread m_tasking_thread;
 		Status m_status;
+		Durability m_durability;
+		Cache_mode m_cache_mode;
+		unsigned m_range_workers;
+		size_t m_buffer_size;
+		bool m_auto_tuning;
+		std::unique_ptr<Concurrency_tuner> m_tuner;
+		std::unique_ptr<Buffer_tuner> m_buffer_tuner;
+
+		struct Progress_event
+		{
+			Path src;
+			Path dst;
+		};
+
+		Spsc_ring<Progress_event> m_progress;
+		std::atomic<unsigned> m_progress_nth;
+		unsigned m_progress_count;
+		std::atomic<uintmax_t> m_progress_dropped;
+
+		IO_task_error_batch m_error_batch;
 
 	public:
 		IO_task(const Path& src, const Path& dst,
@@ -137,27 +282,85 @@ namespace hawk {
 		// Called internally after a successful copy_file()
 		void _increment_offset(uintmax_t file_size);
 		// It is advised to call this method only from the callbacks
-		// called by the IO task itself (e.g. Task_progress_monitor,
-		// File_progress_monitor etc.), otherwise it may result in a race.
+		// called by the IO task itself (e.g. File_progress_monitor),
+		// otherwise it may result in a race.
 		uintmax_t get_offset() const;
 
+		// Per-entry progress events are not reported from the task's
+		// thread. They're queued in a lock-free ring owned by the task
+		// instead and the consumer is expected to drain them periodically
+		// (e.g. from its event loop), so that a slow Task_progress_monitor
+		// never throttles the task itself. When the ring is full, new
+		// events are dropped.
+		//
+		// Calls Task_progress_monitor for at most max queued events
+		// in the calling thread and returns their count. Only a single
+		// thread may drain the events.
+		size_t drain_progress(size_t max = -1);
+
+		// Queue only every nth visited entry. 1 (the default) queues every
+		// entry, 0 turns the per-entry progress off.
+		void set_progress_sampling(unsigned nth);
+
+		// The number of events dropped because the consumer couldn't keep up.
+		uintmax_t dropped_progress() const;
+
+		// Durability::none by default. Must not be called while
+		// the task is running.
+		void set_durability(Durability durability);
+		Durability get_durability() const;
+
+		// Cache_mode::normal by default. Must not be called while
+		// the task is running.
+		void set_cache_mode(Cache_mode cache_mode);
+		Cache_mode get_cache_mode() const;
+
+		// Files of 256 MiB and larger are split into ranges copied by
+		// this many threads, a single sequential stream can't saturate
+		// e.g. NFS or a fast RAID. 1 (the default) turns it off. Must not
+		// be called while the task is running.
+		void set_range_workers(unsigned workers);
+		unsigned get_range_workers() const;
+
+		// The size of the buffer files are copied through, 8 KiB
+		// by default. Must not be called while the task is running.
+		void set_buffer_size(size_t size);
+		size_t get_buffer_size() const;
+
+		// Classify the source and destination devices when the task is
+		// started for the first time and pick the range workers, buffer
+		// size (and IO_task_copy's extent ordering) suited for them,
+		// overriding the values set before. The number of range workers
+		// (up to what the devices take) and the buffer size of the other
+		// copies are then adjusted by the throughput measured during
+		// the first seconds of copying. Off by default.
+		void set_auto_tuning(bool enable);
+
+		// Called internally by the range copying and the other copies
+		// respectively, nullptr unless auto tuning is on.
+		Concurrency_tuner* _get_tuner();
+		Buffer_tuner* _get_buffer_tuner();
+
 	protected:
 		void start_tasking();
 
 		void insert_item(const Item& item);
 		const Item& current_item() const;
 
+		// Queues a progress event, see drain_progress().
+		void queue_progress(const Path& src, const Path& dst);
+
 		virtual void reset_context();
 
-		void handle_symlink(const Path& src,
-							const Path* abs_deref, const Path& dst,
-							std::deque<Item>& items);
+		// abs_deref is the canonical path of the symlink's target. It may
+		// be null in which case the symlink won't be dereferenced, neither
+		// is a symlink to a directory in m_ancestors.
+		int handle_symlink(const Path& src,
+						   const Path* abs_deref, const Path& dst,
+						   std::list<Item>& items);
 
 		virtual void traverse_directory(
 				Recursive_directory_iterator& dir_iter, Item& i) = 0;
-		void traverse_directory(
-				Recursive_directory_iterator it, const Path& i,
-				std::function<bool(const Stat&, const Path&)>&& fn);
 
 		// The task ends with Status::failed if it encounters ENOENT error:
 		// the file/directory no longer exists, the data being processed
@@ -166,34 +369,58 @@ namespace hawk {
 		void may_fail(const FSException& e)
 		{
 			if (e.get_errno() == ENOENT)
+			{
+				flush_errors();
 				throw IO_task_fatal {e.get_source(), ENOENT};
+			}
 			else
 				on_error(e);
 		}
-		void may_fail(const Path& src, const Path& dst, int err) const;
+		// Same as above, non-fatal errors are queued with report_error().
+		void may_fail(const Path& src, const Path& dst, int err);
+
+		// Queues a per-entry error. Queued errors are passed to
+		// on_error(const IO_task_error_batch&) once the task leaves
+		// the directory the failed entry belongs to.
+		void report_error(const Path& src, const Path& dst, int err);
+		void flush_errors();
+
+		// Leaves only the items' sources and their ancestors in m_visited.
+		void reset_visited();
 
 		bool has_enough_space();
 		virtual uintmax_t accumulate_file_size(
 				const Stat& st, const Path& p,
-				Recursive_directory_iterator it,
+				Recursive_directory_iterator& it,
 				bool resumed_state, uintmax_t total, uintmax_t avail,
 				std::deque<Path>& srcs) = 0;
 
-		void process_file(const Item& i);
-		virtual void process_file(const Path& src, const Path& dst) = 0;
-		virtual void process_directory(Item& i) = 0;
-		virtual void process_symlink(const Path& target, const Path& linkpath,
-									 const Path& src) = 0;
+		// process_file and process_symlink return errno on failure
+		// (or 0 on success). src carries the metadata fetched by
+		// the caller.
+		virtual int process_file(File_entry& src, const Path& dst) = 0;
+		virtual void process_directory(Item& i, File_entry& src) = 0;
+		virtual int process_symlink(const Path& target, const Path& linkpath,
+									const Path& src) = 0;
 
 		// These methods below (on_*) are to be implemented by the user.
 
 		virtual void on_error(const IO_task_error& e) const noexcept = 0;
 		virtual void on_error(const Filesystem_error& e) const noexcept = 0;
+		// Called with errors of the entries of a single directory.
+		// The default implementation calls on_error(const IO_task_error&)
+		// for every error in the batch.
+		virtual void on_error(const IO_task_error_batch& b) const noexcept;
 		virtual void on_status_change(Status st) const noexcept = 0;
 
+		virtual void apply_tuning(const IO_tuning& tuning);
+
 	private:
+		void tune();
 		void dispatch_item(Item& i);
 		void tasking();
+		// Throws IO_task_fatal if the data couldn't be synced.
+		void sync_destination();
 		void set_status(Status st);
 	};
 
@@ -202,17 +429,64 @@ namespace hawk {
 	public:
 		using IO_task::IO_task;
 
+		// Copy the files of a directory in batches ordered by their
+		// physical location on the source disk (or by their inode numbers
+		// if the filesystem doesn't support FIEMAP) instead of the order
+		// of the directory entries. Makes a big difference for rotating
+		// disks, off by default. Must not be called while the task
+		// is running.
+		void set_extent_ordering(bool enable);
+
+		// Copies the data to dst as well, reading each source block only
+		// once and writing it to all destinations in parallel. dst gets
+		// the same layout as the destination passed to the constructor
+		// (the primary one). Errors of an additional destination are
+		// reported but don't affect the others, and a destination which
+		// runs out of space or fails for good (EIO, EROFS, ...) is
+		// dropped for the rest of the task. The task as a whole still
+		// fails with the primary destination. Must not be called while
+		// the task is running.
+		void add_destination(const Path& dst);
+
 	private:
+		bool m_extent_ordering = false;
+
+		virtual void apply_tuning(const IO_tuning& tuning);
+
+		// The outputs of the file being copied, the primary one first.
+		// Kept while paused like Context::offset.
+		std::vector<Copy_output> m_outputs;
+		// The writer threads of the additional outputs, created once
+		// a file is copied to more than one output.
+		struct Fanout_release
+		{
+			void operator()(Fanout* fanout) const noexcept;
+		};
+
+		std::unique_ptr<Fanout, Fanout_release> m_fanout;
+
+		Path target_path(const Path& dst, const Target& t) const;
+		void target_error(Target& t, const Path& src, const Path& dst,
+						  int err);
+		void create_target_directories(const Path& src, const Path& dst);
+
+		void schedule_pending();
+		void copy_pending();
+
+		// The walk_tree() policy of traverse_directory().
+		class Walker;
+
 		virtual uintmax_t accumulate_file_size(
 				const Stat& st, const Path& p,
-				Recursive_directory_iterator it,
+				Recursive_directory_iterator& it,
 				bool resumed_state, uintmax_t total, uintmax_t avail,
 				std::deque<Path>& srcs);
 
-		virtual void process_file(const Path& src, const Path& dst);
-		virtual void process_directory(Item& i);
-		virtual void process_symlink(const Path& target, const Path& linkpath,
-									 const Path& src);
+		// Final so that the calls from Walker aren't virtual.
+		virtual int process_file(File_entry& src, const Path& dst) final;
+		virtual void process_directory(Item& i, File_entry& src);
+		virtual int process_symlink(const Path& target, const Path& linkpath,
+									const Path& src) final;
 		virtual void traverse_directory(
 				Recursive_directory_iterator& dir_iter, Item& i);
 	};
@@ -221,8 +495,9 @@ namespace hawk {
 	{
 	private:
 		Stat m_dst_st;
-		int m_prev_level;
-		Path m_prev_path;
+		// Source directories we've entered, the innermost one being
+		// the last. They're removed once the iterator leaves them.
+		std::vector<Path> m_dirs;
 
 	public:
 		IO_task_move(const Path& src, const Path& dst, bool update_symlinks);
@@ -230,20 +505,24 @@ namespace hawk {
 					 bool update_symlinks);
 
 	private:
+		// The walk_tree() policy of traverse_directory().
+		class Walker;
+
 		virtual void traverse_directory(
 				Recursive_directory_iterator& dir_iter, Item& i);
 		void update_symlinks(const Path& src, const Path& dst);
 
 		virtual uintmax_t accumulate_file_size(
 				const Stat& st, const Path& p,
-				Recursive_directory_iterator it,
+				Recursive_directory_iterator& it,
 				bool resumed_state, uintmax_t total, uintmax_t avail,
 				std::deque<Path>& srcs);
 
-		virtual void process_file(const Path& src, const Path& dst);
-		virtual void process_directory(Item& i);
-		virtual void process_symlink(const Path& target, const Path& linkpath,
-									 const Path& src);
+		// Final so that the calls from Walker aren't virtual.
+		virtual int process_file(File_entry& src, const Path& dst) final;
+		virtual void process_directory(Item& i, File_entry& src);
+		virtual int process_symlink(const Path& target, const Path& linkpath,
+									const Path& src) final;
 
 		virtual void reset_context();
 	};
@@ -255,19 +534,22 @@ namespace hawk {
 		explicit IO_task_remove(const std::vector<Path>& pvec);
 
 	private:
+		// The walk_tree() policy of process_directory().
+		class Walker;
+
 		virtual uintmax_t accumulate_file_size(
 				const Stat& st, const Path& p,
-				Recursive_directory_iterator it,
+				Recursive_directory_iterator& it,
 				bool resumed_state, uintmax_t total, uintmax_t avail,
 				std::deque<Path>& srcs);
 
 		virtual void traverse_directory(
 				Recursive_directory_iterator& dir_iter, Item& i);
 
-		virtual void process_file(const Path& src, const Path& dst);
-		virtual void process_directory(Item& i);
-		virtual void process_symlink(const Path& target, const Path& linkpath,
-									 const Path& src);
+		virtual int process_file(File_entry& src, const Path& dst);
+		virtual void process_directory(Item& i, File_entry& src);
+		virtual int process_symlink(const Path& target, const Path& linkpath,
+									const Path& src);
 	};
 }
 
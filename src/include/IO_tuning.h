@@ -0,0 +1,131 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HAWK_IO_TUNING_H
+#define HAWK_IO_TUNING_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include "Path.h"
+
+namespace hawk {
+	enum class Device_class {unknown, rotational, ssd, nvme, network, memory};
+
+	struct Device_info
+	{
+		Device_class type;
+		// The block device's queue depth, 0 if unknown.
+		unsigned nr_requests;
+		// statfs()'s f_type of the filesystem.
+		long fs_type;
+	};
+
+	// Classifies the device p is on using the filesystem type and
+	// /sys/dev/block/<major>:<minor>/queue. Stacked devices (dm, md)
+	// report what the kernel derives from their members.
+	Device_info classify_device(const Path& p) noexcept;
+
+	// IO task parameters suited for a pair of devices.
+	struct IO_tuning
+	{
+		unsigned range_workers;
+		// The most workers the devices may take (see Concurrency_tuner).
+		unsigned max_range_workers;
+		size_t buffer_size;
+		bool extent_ordering;
+	};
+
+	IO_tuning tune_io(const Device_info& src, const Device_info& dst) noexcept;
+
+	// Adjusts the number of workers by the throughput measured during the
+	// first seconds of a job: more workers are tried while they help,
+	// fewer if they don't, and then the count settles for good.
+	class Concurrency_tuner
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+	private:
+		enum class Phase {measure, grow, shrink, settled};
+
+		unsigned m_max;
+		unsigned m_initial;
+		unsigned m_workers;
+		unsigned m_best;
+		double m_best_rate;
+		Phase m_phase;
+
+		Clock::time_point m_period_start;
+		uintmax_t m_period_bytes;
+
+		void probe(Phase phase, unsigned workers, uintmax_t bytes,
+				   Clock::time_point now);
+		void settle(unsigned workers);
+
+	public:
+		Concurrency_tuner(unsigned workers, unsigned max_workers);
+
+		// bytes is the total number of bytes copied so far. Returns
+		// the number of workers to be used from now on.
+		unsigned update(uintmax_t bytes, Clock::time_point now);
+
+		// Starts the current measurement over, e.g. after a pause
+		// in the copying.
+		void restart(uintmax_t bytes, Clock::time_point now);
+
+		unsigned max_workers() const { return m_max; }
+		unsigned workers() const { return m_workers; }
+		bool settled() const { return m_phase == Phase::settled; }
+	};
+
+	// Scales the buffer size of the copies which aren't done by ranges
+	// by the throughput measured, in multiples of a unit the same way
+	// Concurrency_tuner does with the workers.
+	class Buffer_tuner
+	{
+	private:
+		size_t m_unit;
+		uintmax_t m_bytes;
+		Concurrency_tuner m_tuner;
+
+	public:
+		using Clock = Concurrency_tuner::Clock;
+
+		Buffer_tuner(size_t size, size_t max_size);
+
+		// Counts n more bytes copied.
+		void update(size_t n, Clock::time_point now)
+		{
+			m_bytes += n;
+			m_tuner.update(m_bytes, now);
+		}
+
+		// See Concurrency_tuner::restart().
+		void restart(Clock::time_point now)
+		{
+			m_tuner.restart(m_bytes, now);
+		}
+
+		size_t size() const { return m_unit * m_tuner.workers(); }
+	};
+}
+
+#endif // HAWK_IO_TUNING_H
@@ -0,0 +1,270 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HAWK_PARALLEL_WALKER_H
+#define HAWK_PARALLEL_WALKER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Filesystem.h"
+
+namespace hawk {
+	// The scheduling of parallel_walk(), which doesn't depend
+	// on the visitor. Every thread pops the jobs it has queued itself
+	// from the back (depth-first, the directories are likely cached)
+	// while thieves take the oldest (and thus likely the biggest) ones
+	// from the front.
+	class Walk_scheduler
+	{
+	public:
+		struct Job
+		{
+			Path dir;
+			int level;
+		};
+
+	private:
+		struct Queue
+		{
+			std::mutex m;
+			std::deque<Job> jobs;
+		};
+
+		const Walk_options& m_opts;
+		std::vector<Queue> m_queues;
+		// Queued directories along with the ones being read.
+		std::atomic<size_t> m_pending {0};
+		std::atomic<bool> m_stop {false};
+
+		std::mutex m_idle_m;
+		std::condition_variable m_idle_cv;
+
+		std::mutex m_exception_m;
+		std::exception_ptr m_exception;
+
+		dev_t m_root_dev = 0;
+		std::mutex m_visited_m;
+		std::set<std::pair<dev_t, ino_t>> m_visited;
+
+	public:
+		Walk_scheduler(const Walk_options& opts, unsigned threads)
+			: m_opts(opts), m_queues(threads)
+		{}
+
+		const Walk_options& options() const { return m_opts; }
+		unsigned threads() const { return m_queues.size(); }
+
+		// Queues the root, returns errno if it can't be walked.
+		int start(const Path& root) noexcept;
+
+		// Waits for a job for the thread w, false once the walk is over.
+		bool next(unsigned w, Job& job);
+		// The job taken by next() has been done.
+		void done() noexcept;
+		void push(unsigned w, Job&& job);
+
+		// Fails with err if the directory p should be entered
+		// but can't be examined.
+		bool may_enter(const Path& p, int& err);
+
+		void stop() noexcept;
+		bool stopped() const { return m_stop; }
+
+		// Stops the walk, the first exception is rethrown by rethrow().
+		void fail(std::exception_ptr e) noexcept;
+		void rethrow();
+
+		// Only the calling thread (w == 0) can be interrupted.
+		static void interruption_point(unsigned w);
+
+	private:
+		bool pop(unsigned w, Job& job);
+		bool steal(unsigned w, Job& job);
+	};
+
+	unsigned _walk_threads(const Walk_options& opts);
+
+	// The threads of parallel_walk() calling the visitors directly,
+	// so that the per-entry work can be inlined (see walk_tree()).
+	template <typename Visitor>
+	class Parallel_walker
+	{
+	private:
+		using Job = Walk_scheduler::Job;
+
+		Walk_scheduler m_sched;
+		std::vector<Visitor>& m_visitors;
+
+	public:
+		// Every thread works with the visitor of its index.
+		Parallel_walker(const Walk_options& opts,
+						std::vector<Visitor>& visitors)
+			: m_sched{opts, static_cast<unsigned>(visitors.size())},
+			  m_visitors(visitors)
+		{}
+
+		void run(const Path& root)
+		{
+			int err = m_sched.start(root);
+			if (err)
+			{
+				m_visitors[0].error(root, err);
+				return;
+			}
+
+			// Reserved, so that only starting a thread can throw.
+			std::vector<std::thread> threads;
+			threads.reserve(m_sched.threads());
+			for (unsigned i = 1; i < m_sched.threads(); i++)
+			{
+				// E.g. EAGAIN at the thread limit, the threads that did
+				// start steal the jobs of the others (the root directory
+				// is queued for the calling thread).
+				try { threads.emplace_back(&Parallel_walker::work, this, i); }
+				catch (const std::system_error&) { break; }
+			}
+
+			// The calling thread is the only one that can be interrupted.
+			work(0);
+
+			for (std::thread& t : threads)
+				t.join();
+
+			m_sched.rethrow();
+		}
+
+	private:
+		void work(unsigned w) noexcept
+		{
+			try {
+				Job job;
+				while (m_sched.next(w, job))
+				{
+					read_directory(w, job);
+					m_sched.done();
+					m_visitors[w].leave(job.dir);
+				}
+			} catch (...) {
+				m_sched.fail(std::current_exception());
+			}
+		}
+
+		void read_directory(unsigned w, const Job& job)
+		{
+			Visitor& visitor = m_visitors[w];
+			bool follow = (m_sched.options().symlinks
+						   == Walk_options::Symlinks::follow);
+
+			int err;
+			Directory_iterator it {job.dir, err};
+			if (err)
+			{
+				visitor.error(job.dir, err);
+				return;
+			}
+
+			Path path = job.dir;
+			size_t len = path.length();
+
+			while (!it.at_end() && !m_sched.stopped())
+			{
+				Walk_scheduler::interruption_point(w);
+
+				// The path is only built if someone asks for it.
+				Walk_entry e {path, len, it.name(), it.type(err), job.level};
+				if (err)
+					visitor.error(e.path(), err);
+				else
+				{
+					if (e.type == DT_LNK && follow)
+					{
+						Stat st = status(e.path(), err);
+						if (!err)
+							e.type = IFTODT(st.st_mode);
+					}
+
+					Walk_action action = visitor.visit(e);
+					if (action == Walk_action::stop)
+					{
+						m_sched.stop();
+						return;
+					}
+
+					if (action == Walk_action::enter && e.type == DT_DIR)
+					{
+						if (m_sched.may_enter(e.path(), err))
+							m_sched.push(w, {e.path(), job.level + 1});
+						else if (err)
+							visitor.error(e.path(), err);
+					}
+				}
+
+				it.increment(err);
+				if (err)
+					visitor.error(job.dir, err);
+			}
+		}
+	};
+
+	// Walks the tree under root with opts.threads threads, idle threads
+	// steal sub-directories queued by the busy ones. Every thread works
+	// with its own copy of visitor, so no locking is required, the copies
+	// are merged once the walk is over and the result is returned.
+	// Visitor is copyable and provides:
+	//
+	//   Walk_action visit(const Walk_entry& e);
+	//     Walk_action::enter descends into directories, skip prunes
+	//     them and stop ends the whole walk.
+	//   void error(const Path& p, int err);
+	//     Reports a directory (or an entry) that failed to be read.
+	//   void leave(const Path& dir);
+	//     Called once all the entries of dir have been visited.
+	//   void merge(Visitor& other);
+	//     Adds the state of other into this one.
+	//
+	// Interrupting the calling thread (see Interrupt.h) cancels the walk,
+	// exceptions thrown by the visitor are propagated to the caller once
+	// all the threads have finished.
+	template <typename Visitor>
+	Visitor parallel_walk(const Path& root, const Walk_options& opts,
+						  const Visitor& visitor)
+	{
+		unsigned n = _walk_threads(opts);
+		std::vector<Visitor> visitors(n, visitor);
+
+		Parallel_walker<Visitor> walker {opts, visitors};
+		walker.run(root);
+
+		for (unsigned i = 1; i < n; i++)
+			visitors[0].merge(visitors[i]);
+
+		return std::move(visitors[0]);
+	}
+}
+
+#endif // HAWK_PARALLEL_WALKER_H
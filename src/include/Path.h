@@ -23,13 +23,16 @@
 #include <string>
 #include <utility>
 #include <cstddef>
+#include <cstdint>
 #include "Not_self_trait.h"
 
 namespace hawk {
 	class Path
 	{
 	private:
-		mutable size_t m_hash;
+		// The state hash() is computed from, 0 if not known yet.
+		// Kept up to date by the joins and parent walks.
+		mutable uint64_t m_hash;
 		std::string m_path;
 
 	public:
@@ -61,6 +64,8 @@ namespace hawk {
 		bool empty() const;
 
 		std::string::size_type length() const;
+		// Shortens the path to its first len characters.
+		void truncate(std::string::size_type len);
 
 		friend bool operator==(const Path& rhs, const Path& lhs);
 		friend bool operator!=(const Path& rhs, const Path& lhs);
@@ -95,11 +100,16 @@ namespace hawk {
 		bool is_absolute() const;
 
 		// Even though this method is marked as const it
-		// may change the value of m_hash.
+		// may change the value of m_hash. Paths differing only in
+		// redundant separators hash the same.
 		size_t hash() const;
 
 	private:
 		void append_separator_if_needed();
+		// Adds the components from m_path[pos] on to a known m_hash.
+		void hash_appended(std::string::size_type pos);
+		// m_hash of the path truncated to pos (the last separator).
+		uint64_t parent_hash(std::string::size_type pos) const;
 	};
 
 	// Concatenate two paths.
@@ -107,7 +117,8 @@ namespace hawk {
 	Path operator/(const Path& lhs, const char* rhs);
 	Path operator/(const char* lhs, const Path& rhs);
 
-	// Compare two paths by comparing their hashes.
+	// Compare two paths by comparing their hashes (and their strings
+	// if the hashes match).
 	bool operator==(const Path& rhs, const Path& lhs);
 	bool operator!=(const Path& rhs, const Path& lhs);
 
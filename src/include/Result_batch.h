@@ -0,0 +1,106 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HAWK_RESULT_BATCH_H
+#define HAWK_RESULT_BATCH_H
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace hawk {
+	// Hands the batches of the walking threads over to fn,
+	// one thread at a time.
+	template <typename Result>
+	class Batch_sink
+	{
+	public:
+		using Callback = std::function<void(const std::vector<Result>&)>;
+
+	private:
+		std::mutex m_mtx;
+		const Callback& m_fn;
+
+	public:
+		explicit Batch_sink(const Callback& fn) : m_fn(fn) {}
+
+		void operator()(const std::vector<Result>& batch)
+		{
+			std::lock_guard<std::mutex> lk {m_mtx};
+			m_fn(batch);
+		}
+	};
+
+	// Collects the results of a walking thread, they're handed over to
+	// the sink in batches of batch_size, or sooner if they're sparse
+	// (see flush_if_due()).
+	template <typename Result>
+	class Result_batch
+	{
+	private:
+		using Clock = std::chrono::steady_clock;
+
+		Batch_sink<Result>* m_sink;
+		size_t m_size;
+		Clock::duration m_delay;
+
+		std::vector<Result> m_results;
+		Clock::time_point m_start;
+
+	public:
+		explicit Result_batch(
+				Batch_sink<Result>& sink, size_t batch_size = 64,
+				Clock::duration delay = std::chrono::milliseconds {50})
+			: m_sink(&sink), m_size{batch_size}, m_delay{delay}
+		{}
+
+		void add(Result&& r)
+		{
+			if (m_results.empty())
+				m_start = Clock::now();
+
+			m_results.push_back(std::move(r));
+			if (m_results.size() >= m_size)
+				flush();
+			else
+				flush_if_due();
+		}
+
+		// Flushes the batch if its first result has waited long enough,
+		// called by the visitors between directories (or files).
+		void flush_if_due()
+		{
+			if (!m_results.empty() && Clock::now() - m_start >= m_delay)
+				flush();
+		}
+
+		void flush()
+		{
+			if (m_results.empty())
+				return;
+
+			(*m_sink)(m_results);
+			m_results.clear();
+		}
+	};
+}
+
+#endif // HAWK_RESULT_BATCH_H
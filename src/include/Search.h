@@ -0,0 +1,112 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HAWK_SEARCH_H
+#define HAWK_SEARCH_H
+
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <limits>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+#include <functional>
+#include "Filesystem.h"
+
+namespace hawk {
+	// Matches file names against a glob (*, ? and [...] classes, \ escapes)
+	// or an ECMAScript regex. Names are matched as raw bytes, common glob
+	// shapes (literal, *literal*, literal*, *literal) don't run the glob
+	// matcher at all and the others are prefiltered by their longest
+	// literal part using memmem().
+	class Name_pattern
+	{
+	private:
+		enum class Kind {any, exact, prefix, suffix, contains, glob, regex};
+
+		Kind m_kind;
+		bool m_ignore_case;
+		std::string m_pattern;
+		// The longest part of a glob every matching name contains.
+		std::string m_literal;
+		std::shared_ptr<std::regex> m_regex;
+
+	public:
+		// An empty pattern matches everything. Throws std::regex_error
+		// if the regex is invalid.
+		explicit Name_pattern(const std::string& pattern = std::string{},
+							  bool regex = false, bool ignore_case = false);
+
+		bool matches(const char* name, size_t len) const;
+		bool matches(const char* name) const
+		{
+			return matches(name, std::strlen(name));
+		}
+
+		// A string every matching name contains (lowered if the case
+		// is ignored), empty if there's none, e.g. for regexes.
+		const std::string& literal() const { return m_literal; }
+
+	private:
+		bool matches_lowered(const char* name, size_t len) const;
+	};
+
+	struct Search_query
+	{
+		Name_pattern name;
+		// One of the DT_* constants, DT_UNKNOWN matches all types.
+		unsigned char type = DT_UNKNOWN;
+		// Limits for regular files, other types aren't filtered by size.
+		uintmax_t min_size = 0;
+		uintmax_t max_size = std::numeric_limits<uintmax_t>::max();
+		// Modification time range (inclusive).
+		time_t newer_than = std::numeric_limits<time_t>::min();
+		time_t older_than = std::numeric_limits<time_t>::max();
+		// Zero searches only the entries of the root, -1 is unlimited.
+		int max_depth = -1;
+		// Threads, symlink and filesystem policy of the walk.
+		Walk_options walk;
+	};
+
+	struct Search_result
+	{
+		Path path;
+		unsigned char type;
+	};
+
+	using Search_callback =
+		std::function<void(const std::vector<Search_result>& results)>;
+
+	// Searches the tree under root on several threads (see parallel_walk()).
+	// Matches are handed to fn in batches as they're found, fn is called
+	// by the walking threads, one at a time. Names are matched before
+	// anything else is done with an entry, the full path is only built
+	// for matching entries and stat() only called for them if there are
+	// size or time limits.
+	//
+	// The search is cancelled by interrupting the calling thread, e.g.
+	// by running another task on the same Tasking.
+	void search(const Path& root, const Search_query& query,
+				const Search_callback& fn);
+}
+
+#endif // HAWK_SEARCH_H
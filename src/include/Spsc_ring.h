@@ -0,0 +1,104 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef HAWK_SPSC_RING_H
+#define HAWK_SPSC_RING_H
+
+#include <vector>
+#include <atomic>
+#include <cstddef>
+
+namespace hawk {
+	// A bounded lock-free single-producer/single-consumer queue.
+	// Slots are never destroyed, only re-assigned, so that e.g. strings
+	// stored in them keep their capacity and pushing doesn't allocate
+	// once the ring has warmed up. Capacity is rounded up to a power of 2.
+	template <typename T>
+	class Spsc_ring
+	{
+	private:
+		std::vector<T> m_slots;
+		size_t m_mask;
+
+		// Keep the consumer and producer indices on separate cache lines.
+		std::atomic<size_t> m_head; // Owned by the consumer.
+		char m_pad[64 - sizeof(std::atomic<size_t>)];
+		std::atomic<size_t> m_tail; // Owned by the producer.
+
+	public:
+		explicit Spsc_ring(size_t capacity)
+			: m_head{0}, m_tail{0}
+		{
+			size_t cap = 1;
+			while (cap < capacity) cap <<= 1;
+
+			m_slots.resize(cap);
+			m_mask = cap - 1;
+		}
+
+		Spsc_ring(const Spsc_ring&) = delete;
+		Spsc_ring& operator=(const Spsc_ring&) = delete;
+
+		// Producer side. Calls fill(T&) on the next free slot.
+		// Returns false if the ring is full, in which case fill
+		// is not called.
+		template <typename Fill>
+		bool push(Fill&& fill)
+		{
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+			if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+				return false;
+
+			fill(m_slots[tail & m_mask]);
+			m_tail.store(tail + 1, std::memory_order_release);
+
+			return true;
+		}
+
+		// Consumer side. Calls fn(T&) on at most max queued items
+		// (in FIFO order) and returns their count.
+		template <typename Fn>
+		size_t consume(Fn&& fn, size_t max)
+		{
+			size_t head = m_head.load(std::memory_order_relaxed);
+			size_t tail = m_tail.load(std::memory_order_acquire);
+
+			size_t n = tail - head;
+			if (n > max) n = max;
+
+			for (size_t i = 0; i != n; i++)
+				fn(m_slots[(head + i) & m_mask]);
+
+			m_head.store(head + n, std::memory_order_release);
+
+			return n;
+		}
+
+		// Consumer side. Discards every queued item.
+		void clear()
+		{
+			m_head.store(m_tail.load(std::memory_order_acquire),
+						 std::memory_order_release);
+		}
+
+		size_t capacity() const { return m_slots.size(); }
+	};
+}
+
+#endif // HAWK_SPSC_RING_H
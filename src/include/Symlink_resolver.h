@@ -0,0 +1,113 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef HAWK_SYMLINK_RESOLVER_H
+#define HAWK_SYMLINK_RESOLVER_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <sys/types.h>
+#include "Path.h"
+#include "Filesystem.h"
+
+namespace hawk {
+	// Resolves symlinks like canonical(link, "/") does, but keeps the
+	// results for the duration of a walk. Symlinks are keyed by the device
+	// and inode of their directory and their name, canonical paths of
+	// directories by their device and inode, so resolving the symlinks of
+	// a tree doesn't resolve the same ancestors over and over again
+	// (realpath() looks up every component of the path).
+	//
+	// The cache isn't invalidated, it's meant to live as long
+	// as a single walk.
+	class Symlink_resolver
+	{
+	private:
+		using Id = std::pair<dev_t, ino_t>;
+
+		struct Link
+		{
+			Path target;
+			int err;
+		};
+
+		std::map<Id, std::string> m_dirs;
+		std::map<std::pair<Id, std::string>, Link> m_links;
+
+	public:
+		// Returns the canonical path of link's target.
+		Path resolve(const Path& link, int& err);
+		void clear();
+
+	private:
+		const Link& resolve(const Id& dir_id, const std::string& dir,
+							const std::string& name, int depth);
+		const std::string& canonical_directory(const Id& id,
+											   const std::string& dir,
+											   int& err);
+	};
+
+	// Directories identified by their device and inode, used to detect
+	// symlinks pointing to a directory a walk has already been through
+	// (e.g. one of its ancestors).
+	class Visited_directories
+	{
+	private:
+		std::set<std::pair<dev_t, ino_t>> m_dirs;
+
+	public:
+		// Returns false if the directory has been visited already.
+		bool insert(const Stat& st);
+		// Inserts p and all of its ancestors.
+		void insert_ancestors(const Path& p);
+		// Whether p (following symlinks) is a visited directory.
+		bool contains(const Path& p) const;
+		void clear();
+	};
+
+	// The directories above the entry a walk is at, identified by their
+	// device and inode. A symlink to one of them would make the walk loop.
+	// Directories are pushed as the walk enters them and popped by leave()
+	// as it moves up, the ones pushed before set_top() stay.
+	class Ancestor_directories
+	{
+	private:
+		std::vector<std::pair<dev_t, ino_t>> m_dirs;
+		size_t m_top = 0;
+
+	public:
+		void push(const Stat& st);
+		// Pushes p (unless it's a symlink) and all of its ancestors.
+		void push_ancestors(const Path& p);
+		// Marks the directory pushed last as the top of a walk.
+		void set_top();
+		// Pops the directories entered below level of the walk.
+		void leave(int level);
+		// Whether p (following symlinks) is one of the directories.
+		bool contains(const Path& p) const;
+		void clear();
+	};
+}
+
+#endif // HAWK_SYMLINK_RESOLVER_H
@@ -0,0 +1,73 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HAWK_TREE_WALKER_H
+#define HAWK_TREE_WALKER_H
+
+#include "Filesystem.h"
+#include "Interrupt.h"
+
+namespace hawk {
+	// Walks it calling the members of the policy directly
+	// so that the per-entry work can be inlined, there is no indirect call
+	// or allocation on the walker's side. Policy provides:
+	//
+	//   void before(const Recursive_directory_iterator& it);
+	//     Called before each entry.
+	//   Walk_action visit(const Path& rel, const Path& path,
+	//                     const Stat& st, int err);
+	//     rel is relative to the iterator's top directory, path is
+	//     the full path and st is its symlink_status()
+	//     which failed with err if it isn't 0. Walk_action::enter only
+	//     descends into directories, other entries are skipped.
+	//   void advanced(const Path& rel, int err);
+	//     Called after the iterator has moved, err is its error.
+	//
+	// An entry is visited before the iterator moves past it, so that
+	// a walk interrupted in visit() resumes at the same entry.
+	template <typename Policy>
+	void walk_tree(Recursive_directory_iterator& it, Policy& policy)
+	{
+		int err;
+		while (!it.at_end())
+		{
+			policy.before(it);
+			hard_interruption_point();
+
+			// The full path is only valid until the iterator moves.
+			Path rel = *it;
+			const Path& path = it.path();
+			Stat st = symlink_status(path, err);
+
+			Walk_action action = policy.visit(rel, path, st, err);
+			if (action == Walk_action::stop)
+				break;
+
+			if (action == Walk_action::enter)
+				it.increment(err);
+			else
+				it.orthogonal_increment(err);
+
+			policy.advanced(rel, err);
+		}
+	}
+}
+
+#endif // HAWK_TREE_WALKER_H
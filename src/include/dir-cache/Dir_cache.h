@@ -23,6 +23,8 @@
 #include <functional>
 #include <chrono>
 #include "dir-cache/Dir_entry.h"
+#include "dir-cache/Size_cache.h"
+#include "dir-cache/Name_index.h"
 
 namespace hawk
 {
@@ -53,6 +55,21 @@ namespace hawk
 	// for the vector pointed to by Dir_ptr may be reused by another cache entry.
 	void load_dir_ptr(Dir_ptr& ptr, const Path& directory,
 					  bool force_reload = false);
+
+	// Returns the total size of the tree under directory. Sizes are
+	// cached for every directory walked and invalidated (along with
+	// their ancestors) once the filesystem-watchdog reports a change
+	// or once they get too old.
+	// See dir-cache/Size_cache.h
+	Tree_size directory_size(const Path& directory);
+	// Doesn't walk the tree, returns false if the size isn't known.
+	bool cached_directory_size(const Path& directory, Tree_size& size);
+
+	// Keeps index up to date with the changes reported by the
+	// filesystem-watchdog (i.e. in the directories that have been
+	// loaded). Passing nullptr detaches the index.
+	// See dir-cache/Name_index.h
+	void set_name_index(std::shared_ptr<Name_index> index);
 }
 
 #endif // HAWK_DIR_CACHE_H
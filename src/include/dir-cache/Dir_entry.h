@@ -23,6 +23,7 @@
 #include <memory>
 #include <vector>
 #include <functional>
+#include <dirent.h>
 #include "Path.h"
 #include "User_data.h"
 
@@ -30,6 +31,8 @@ namespace hawk {
 	struct Dir_entry
 	{
 		Path path;
+		// One of the DT_* constants, as reported by the directory stream.
+		unsigned char type = DT_UNKNOWN;
 		User_data user_data;
 	};
 
@@ -0,0 +1,132 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef HAWK_NAME_INDEX_H
+#define HAWK_NAME_INDEX_H
+
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Path.h"
+#include "Filesystem.h"
+#include "Interruptible_thread.h"
+#include "Search.h"
+
+namespace hawk {
+	// A locate-like index of the paths under a directory, kept in a file
+	// that is mapped into memory, so that opening it is instant. Paths
+	// are stored sorted and front-coded (each one as the length of the
+	// prefix shared with the previous one and the rest) in blocks that
+	// start with a complete path. Every trigram of the (lowered) names
+	// has a list of the paths containing it, names are only matched
+	// against the paths sharing all the trigrams of the query's literal.
+	//
+	// Changes are kept in memory on top of the file until save() is
+	// called. All methods are thread-safe.
+	class Name_index
+	{
+	private:
+		// Guards the state read by find(), it's only held briefly by
+		// the changes. The changes themselves are serialized by
+		// m_write_mtx, so that the file is written without blocking
+		// the readers.
+		mutable std::mutex m_mtx;
+		std::mutex m_write_mtx;
+		Path m_file;
+
+		// The mapped file.
+		const char* m_data = nullptr;
+		size_t m_size = 0;
+		std::string m_root;
+		uint64_t m_count = 0;
+
+		// Paths removed from the file and the ones added since.
+		std::vector<bool> m_removed;
+		uint64_t m_removed_count = 0;
+		std::set<std::string> m_added;
+
+		// Directories queued by update() for m_updater.
+		std::mutex m_queue_mtx;
+		std::condition_variable m_queue_cv;
+		std::deque<std::pair<std::string, bool>> m_queue;
+		bool m_stop = false;
+		Interruptible_thread m_updater;
+
+	public:
+		// Maps the index stored in file, if there's none (or it isn't
+		// valid) the index is empty.
+		explicit Name_index(const Path& file);
+		~Name_index();
+
+		Name_index(const Name_index&) = delete;
+		Name_index& operator=(const Name_index&) = delete;
+
+		// Indexes the tree under root (in parallel, see parallel_walk())
+		// and stores it. The walk can be cancelled by interrupting
+		// the calling thread.
+		void build(const Path& root, const Walk_options& opts = {});
+		// Stores the changes made since the file was written.
+		void save();
+
+		// Queues dir to have its entries re-read (or to be dropped
+		// along with its sub-tree if it's been deleted) by a worker
+		// thread, new sub-directories are indexed as a whole. It's meant
+		// to be fed by a Dir_watchdog, so it doesn't block.
+		void update(const Path& dir, bool deleted = false);
+
+		// Returns the sorted paths whose names match pattern, at most
+		// limit of them (zero is unlimited).
+		std::vector<Path> find(const Name_pattern& pattern,
+							   size_t limit = 0) const;
+
+		Path root() const;
+		size_t size() const;
+
+	private:
+		void map_file();
+		void unmap_file();
+		// Called with m_write_mtx held.
+		void write(const std::string& root,
+				   const std::vector<std::string>& paths);
+
+		void process_updates();
+		void apply_update(const std::string& dir, bool deleted);
+
+		// Index of the first stored path not less than s.
+		uint64_t lower_bound(const std::string& s) const;
+		// Decodes the stored paths from first to last, fn returns false
+		// to stop.
+		template <typename Fn>
+		void decode(uint64_t first, uint64_t last, Fn fn) const;
+
+		void remove(const std::string& p);
+		void remove_tree(const std::string& p);
+		void mark_removed(uint64_t i);
+		std::set<std::string> indexed_children(const std::string& dir) const;
+	};
+}
+
+#endif // HAWK_NAME_INDEX_H
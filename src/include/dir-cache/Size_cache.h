@@ -0,0 +1,109 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef HAWK_SIZE_CACHE_H
+#define HAWK_SIZE_CACHE_H
+
+#include <cstdint>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Path.h"
+
+namespace hawk {
+	// Totals of a directory tree, the directory itself isn't counted.
+	struct Tree_size
+	{
+		uintmax_t bytes = 0; // Apparent size of the files.
+		uintmax_t files = 0; // Non-directories, symlinks aren't followed.
+		uintmax_t dirs = 0;
+	};
+
+	// Computes the sizes of directory trees and keeps them. A single
+	// walk caches the size of every directory under the one asked for,
+	// so that querying (and sorting by) the sizes of sub-directories
+	// is a lookup. Changed directories are invalidated along with their
+	// ancestors. Only the changes in the watched directories are
+	// reported, so the sizes also expire after a while, and the oldest
+	// walks are dropped once there are too many directories cached.
+	// All methods are thread-safe.
+	class Size_cache
+	{
+	public:
+		using Clock = std::chrono::steady_clock;
+
+	private:
+		struct Entry
+		{
+			Tree_size size;
+			// When the walk which computed the size started.
+			Clock::time_point time;
+		};
+
+		// A walk in progress, the directories invalidated meanwhile
+		// (and whether they've been deleted) are dropped from its
+		// results before they're stored.
+		struct Pending_walk
+		{
+			std::vector<std::pair<std::string, bool>> invalidated;
+			bool cleared = false;
+		};
+
+		std::mutex m_mtx;
+		std::unordered_map<std::string, Entry> m_sizes;
+		// Start times of the walks stored, oldest first.
+		std::deque<Clock::time_point> m_walks;
+		std::list<Pending_walk> m_pending;
+
+		Clock::duration m_max_age;
+		size_t m_max_entries;
+
+	public:
+		explicit Size_cache(
+				Clock::duration max_age = std::chrono::minutes {1},
+				size_t max_entries = 64 * 1024)
+			: m_max_age{max_age}, m_max_entries{max_entries}
+		{}
+
+		// Returns the cached size or walks the tree (in parallel, see
+		// parallel_walk()) on the calling thread. The walk can be
+		// cancelled by interrupting the thread.
+		Tree_size get(const Path& dir);
+		// Returns false if the size of dir isn't cached.
+		bool find(const Path& dir, Tree_size& size);
+
+		// The contents of dir have changed. If it has been deleted, the
+		// sizes of its sub-directories are dropped as well.
+		void invalidate(const Path& dir, bool deleted = false);
+		void clear();
+
+	private:
+		bool expired(const Entry& e, Clock::time_point now) const;
+		// Drops the oldest walks until the entries fit.
+		void evict();
+	};
+}
+
+#endif // HAWK_SIZE_CACHE_H
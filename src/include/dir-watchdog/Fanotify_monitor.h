@@ -0,0 +1,118 @@
+/*
+	Copyright (C) 2013-2015 Róbert "gman" Vašek <gman@codefreax.org>
+
+	This file is part of libhawk.
+
+	libhawk is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	libhawk is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with libhawk.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef HAWK_FANOTIFY_MONITOR_H
+#define HAWK_FANOTIFY_MONITOR_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <chrono>
+#include <poll.h>
+#include "Path.h"
+#include "dir-watchdog/Monitor.h"
+#include "dir-watchdog/Inotify_monitor.h"
+
+namespace hawk {
+	// Fanotify_monitor marks whole filesystems (FAN_MARK_FILESYSTEM) for
+	// the changes of directory entries. Events carry the file handle of the
+	// directory along with the entry's name (FAN_REPORT_DFID_NAME) and are
+	// mapped back to the watched directories by the handle.
+	//
+	// Modifications of files would be reported for the whole filesystem
+	// though, so they're asked for by an inode mark of every watched
+	// directory. Adding a directory thus still costs a statfs(),
+	// a name_to_handle_at() and a fanotify_mark(), and the inode marks
+	// count against the fanotify mark limit (like the inotify watches
+	// count against theirs). A directory which can't be marked is
+	// watched by the Inotify_monitor below.
+	//
+	// Marking a filesystem requires CAP_SYS_ADMIN, directories on filesystems
+	// that can't be marked (or every directory if fanotify isn't available)
+	// are watched by an Inotify_monitor instead.
+	//
+	// Like with Inotify_monitor, the notifications are broadcasted once
+	// there are no more events to read, and at least every timeout while
+	// the events keep coming.
+	class Fanotify_monitor : public Monitor
+	{
+	private:
+		using Clock = std::chrono::steady_clock;
+
+		struct Watch
+		{
+			// The directory can be added by several paths.
+			std::vector<Path> paths;
+			Event ev;
+		};
+
+		// root is the top directory of the filesystem, the mark is removed
+		// through it as the watched directories may have been deleted.
+		struct Mark
+		{
+			bool marked;
+			size_t watches;
+			Path root;
+		};
+
+		int m_fd; // fanotify fd, -1 if not available
+		pollfd m_pfd;
+		std::chrono::milliseconds m_timeout;
+		Clock::time_point m_last_broadcast;
+
+		// Watches keyed by the directories' fsid and file handle.
+		std::unordered_map<std::string, Watch> m_watches;
+		// Paths of the watched directories to their keys.
+		std::unordered_map<std::string, std::string> m_keys;
+		// Marks keyed by fsid.
+		std::unordered_map<std::string, Mark> m_marks;
+
+		std::unique_ptr<Inotify_monitor> m_fallback;
+		std::unordered_set<std::string> m_fallback_paths;
+
+	public:
+		Fanotify_monitor(std::chrono::milliseconds timeout);
+		~Fanotify_monitor();
+
+		virtual void add_path(const Path& dir);
+		virtual void remove_path(const Path& dir);
+
+		virtual void watch() noexcept;
+
+	private:
+		void add_fallback_path(const Path& dir);
+		bool mark_filesystem(const std::string& fsid, const Path& dir);
+		// Removes the mark of fsid once it isn't used by any watch.
+		void unmark_filesystem(const std::string& fsid);
+
+		void read_events() noexcept;
+		void process_event(uint64_t mask, const char* info,
+						   const char* end);
+		void set_event(const std::string& dir, Event ev);
+		// Marks every watch modified when events have been lost.
+		void set_all_modified();
+		void broadcast_notifications();
+	};
+}
+
+#endif // HAWK_FANOTIFY_MONITOR_H